@@ -0,0 +1,102 @@
+#pragma once
+
+#include <tuple>
+
+#include "misc.hpp"
+#include "perf_counters.hpp"
+#include "scan_index.hpp"
+
+namespace sketch_search {
+
+// Utilities shared by the benchmark executables
+
+constexpr double ABORT_BORDER_IN_MS = 1000.0;
+
+// Searchers use one thread per query, except that the scan of a single closed-loop searcher is split
+// into the given #threads
+template <class Searcher>
+void set_query_threads(Searcher&, int) {}
+inline void set_query_threads(scan_index::searcher& searcher, int threads) {
+    searcher.set_threads(threads);
+}
+
+inline std::vector<std::string> string_split(const std::string& s, char delim) {
+    std::vector<std::string> elems;
+    std::string item;
+    for (char ch : s) {
+        if (ch == delim) {
+            if (!item.empty()) elems.push_back(item);
+            item.clear();
+        } else {
+            item += ch;
+        }
+    }
+    if (!item.empty()) elems.push_back(item);
+    return elems;
+}
+
+// Parses a comma-separated list such as "1,2,4", exiting on an element not parsed completely
+template <class T>
+inline std::vector<T> parse_list(const std::string& str) {
+    std::vector<T> list;
+    for (const auto& elem : string_split(str, ',')) {
+        std::istringstream iss(elem);
+        T v;
+        if (!(iss >> v) or !(iss >> std::ws).eof()) {
+            std::cerr << "error: invalid element " << elem << " in " << str << std::endl;
+            exit(1);
+        }
+        list.push_back(v);
+    }
+    return list;
+}
+
+inline std::tuple<int, int, int> parse_range(const std::string& range_str) {
+    auto elems = string_split(range_str, ':');
+    if (elems.size() == 1) {
+        int max = std::stoi(elems[0]);
+        return {0, max, 1};
+    }
+    if (elems.size() == 2) {
+        int min = std::stoi(elems[0]);
+        int max = std::stoi(elems[1]);
+        return {min, max, 1};
+    }
+    if (elems.size() == 3) {
+        int min = std::stoi(elems[0]);
+        int max = std::stoi(elems[1]);
+        int stp = std::stoi(elems[2]);
+        return {min, max, stp};
+    }
+
+    std::cerr << "error: invalid format of range string " << range_str << std::endl;
+    exit(1);
+}
+
+// Prints the hardware counters divided by num_units, e.g., #queries
+inline void print_perf(const perf_counters& perf, double num_units, const char* unit) {
+    using pc = perf_counters;
+    std::cout << "    perf per " << unit << ": IPC ";
+    if (perf.has_value(pc::CYCLES) and perf.has_value(pc::INSTRUCTIONS) and perf.get(pc::CYCLES) != 0.0) {
+        std::cout << perf.get(pc::INSTRUCTIONS) / perf.get(pc::CYCLES);
+    } else {
+        std::cout << "n/a";
+    }
+    for (int e : {pc::LLC_MISSES, pc::DTLB_MISSES}) {
+        std::cout << "; " << pc::get_name(e) << " ";
+        if (perf.has_value(e)) {
+            std::cout << perf.get(e) / num_units;
+        } else {
+            std::cout << "n/a";
+        }
+    }
+    std::cout << "; branch_miss_rate ";
+    if (perf.has_value(pc::BRANCHES) and perf.has_value(pc::BRANCH_MISSES) and perf.get(pc::BRANCHES) != 0.0) {
+        std::cout << perf.get(pc::BRANCH_MISSES) / perf.get(pc::BRANCHES) * 100.0 << "%";
+    } else {
+        std::cout << "n/a";
+    }
+    std::cout << std::endl;
+}
+
+}  // namespace sketch_search
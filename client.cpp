@@ -0,0 +1,114 @@
+#include "bench_utils.hpp"
+#include "histogram.hpp"
+#include "server_protocol.hpp"
+
+#include "cmdline.h"
+
+using namespace sketch_search;
+
+// Receives a response, returning false on a broken connection
+bool receive(int fd, protocol::header_t& header, std::vector<uint8_t>& payload) {
+    if (!protocol::read_full(fd, &header, sizeof(header))) {
+        return false;
+    }
+    payload.resize(header.size);
+    return protocol::read_full(fd, payload.data(), payload.size());
+}
+
+int main(int argc, char* argv[]) {
+    cmdline::parser p;
+    p.add<std::string>("socket_fn", 's', "file name of Unix domain socket", true);
+    p.add<std::string>("query_fn", 'q', "input file name of query sketches", false, "");
+    p.add<int>("dim", 'm', "dimension of the index (<= 64)", false, 32);
+    p.add<int>("bits", 'b', "#bits of alphabet of the index (<= 8)", false, 2);
+    p.add<int>("index", 'x', "position of the index in the server", false, 0);
+    p.add<std::string>("errs_range", 'e', "range of errs (min:max:step)", false, "1:5:1");
+    p.add<int>("batch", 'c', "#queries per request", false, 100);
+    p.add<std::string>("reload_fn", 'r', "file name of a new index to be swapped in", false, "");
+    p.add<bool>("stats", 'S', "print the metrics of the server", false, false);
+    p.parse_check(argc, argv);
+
+    auto socket_fn = p.get<std::string>("socket_fn");
+    auto query_fn = p.get<std::string>("query_fn");
+    auto index = uint8_t(p.get<int>("index"));
+    auto batch = std::max(p.get<int>("batch"), 1);
+    auto reload_fn = p.get<std::string>("reload_fn");
+
+    const int fd = protocol::connect_unix(socket_fn);
+    if (fd < 0) {
+        std::cerr << "error: cannot connect to " << socket_fn << std::endl;
+        return 1;
+    }
+
+    protocol::header_t header;
+    std::vector<uint8_t> payload;
+
+    if (!reload_fn.empty()) {
+        protocol::header_t req = {protocol::RELOAD, index, 0, 0, uint32_t(reload_fn.size())};
+        if (!protocol::send_message(fd, req, reload_fn.data()) or !receive(fd, header, payload)) {
+            std::cerr << "error: connection closed" << std::endl;
+            return 1;
+        }
+        std::cout << std::string(payload.begin(), payload.end()) << std::endl;
+        if (header.code != protocol::OK) {
+            return 1;
+        }
+    }
+
+    if (!query_fn.empty()) {
+        config_t conf;
+        conf.dim = p.get<int>("dim");
+        conf.bits = p.get<int>("bits");
+        const auto queries = load_sketches(query_fn, conf);
+        const size_t num_queries = queries.size() / conf.dim;
+
+        int min_errs, max_errs, err_step;
+        std::tie(min_errs, max_errs, err_step) = parse_range(p.get<std::string>("errs_range"));
+
+        latency_histogram hist;
+        for (int errs = min_errs; errs <= max_errs; errs += err_step) {
+            uint64_t num_ans = 0;
+            hist.clear();
+            timer t;
+            for (size_t beg = 0; beg < num_queries; beg += batch) {
+                const size_t end = std::min(beg + batch, num_queries);
+                protocol::header_t req = {protocol::QUERY, index, uint8_t(errs), 0,
+                                          uint32_t((end - beg) * conf.dim)};
+                timer rt;
+                if (!protocol::send_message(fd, req, queries.data() + beg * conf.dim) or
+                    !receive(fd, header, payload)) {
+                    std::cerr << "error: connection closed" << std::endl;
+                    return 1;
+                }
+                hist.record(uint64_t(rt.get<std::chrono::nanoseconds>()));
+                if (header.code != protocol::OK) {
+                    std::cerr << "error: " << std::string(payload.begin(), payload.end()) << std::endl;
+                    return 1;
+                }
+                for (size_t pos = 0; pos < payload.size();) {
+                    uint32_t n;
+                    std::memcpy(&n, payload.data() + pos, sizeof(uint32_t));
+                    pos += sizeof(uint32_t) + n * protocol::ANSWER_BYTES;
+                    num_ans += n;
+                }
+            }
+            const double elapsed = t.get<std::chrono::microseconds>() / 1000.0;
+            std::cout << "--> " << errs << " errs; " << double(num_ans) / num_queries << " ans; "
+                      << elapsed / num_queries << " ms; request latency in us: p50 "
+                      << hist.get_percentile(50.0) / 1000.0 << "; p99 " << hist.get_percentile(99.0) / 1000.0
+                      << std::endl;
+        }
+    }
+
+    if (p.get<bool>("stats")) {
+        protocol::header_t req = {protocol::STATS, index, 0, 0, 0};
+        if (!protocol::send_message(fd, req, nullptr) or !receive(fd, header, payload)) {
+            std::cerr << "error: connection closed" << std::endl;
+            return 1;
+        }
+        std::cout << std::string(payload.begin(), payload.end());
+    }
+
+    ::close(fd);
+    return 0;
+}
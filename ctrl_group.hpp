@@ -0,0 +1,50 @@
+#pragma once
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Group of control bytes for Swiss-table style probing. Each slot of a hash table has one control byte
+// that is EMPTY or the 7-bit tag of the key in the slot, and the bytes of a group are matched at once.
+struct ctrl_group {
+    static constexpr size_t SIZE = 16;
+    static constexpr uint8_t EMPTY = 0x80;
+
+    // Bit i is set iff ctrls[i] == tag
+    static uint32_t match(const uint8_t* ctrls, uint8_t tag) {
+#ifdef __SSE2__
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrls));
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(char(tag)))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < SIZE; ++i) {
+            mask |= uint32_t(ctrls[i] == tag) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Bit i is set iff ctrls[i] == EMPTY
+    static uint32_t match_empty(const uint8_t* ctrls) {
+#ifdef __SSE2__
+        // Only EMPTY has the highest bit
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrls));
+        return uint32_t(_mm_movemask_epi8(group));
+#else
+        return match(ctrls, EMPTY);
+#endif
+    }
+
+    static uint8_t get_tag(uint64_t hash) {
+        return uint8_t(hash & 0x7F);
+    }
+    static size_t get_group(uint64_t hash, size_t num_groups) {
+        return (hash >> 7) % num_groups;
+    }
+};
+
+}  // namespace sketch_search
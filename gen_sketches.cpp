@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "cmdline.h"
+#include "misc.hpp"
+
+using namespace sketch_search;
+
+// Keys are generated in chunks, each from its own random engine seeded by (seed, stream, chunk ID),
+// so the output depends only on the options and not on the number of threads.
+static constexpr size_t CHUNK_SIZE = 1U << 16;
+static constexpr size_t CHUNKS_PER_THREAD = 4;  // per batch written at once
+
+enum class dist_types : int { UNIFORM, ZIPF, CLUSTER, PLANTED };
+enum streams : uint64_t { BASE_STREAM = 1, QUERY_STREAM, CENTER_STREAM, PERM_STREAM };
+
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+class sketch_generator {
+  public:
+    sketch_generator(const config_t& conf, dist_types dist_type, uint64_t seed)
+        : m_conf(conf), m_dist_type(dist_type), m_seed(seed), m_mask((1U << conf.bits) - 1) {}
+
+    // Zipf distribution with exponent s at every dimension, where the ranks of the integers are
+    // permuted differently for each dimension
+    void set_zipf(double s) {
+        const uint32_t sigma = m_mask + 1;
+        std::vector<double> cdf(sigma);
+        double sum = 0.0;
+        for (uint32_t k = 0; k < sigma; ++k) {
+            sum += 1.0 / std::pow(k + 1.0, s);
+            cdf[k] = sum;
+        }
+        for (auto& c : cdf) {
+            c /= sum;
+        }
+        m_zipf_cdf = cdf;
+
+        m_zipf_perms.resize(size_t(m_conf.dim) * sigma);
+        std::mt19937_64 engine(get_seed_(PERM_STREAM, 0));
+        for (int i = 0; i < m_conf.dim; ++i) {
+            uint8_t* perm = m_zipf_perms.data() + size_t(i) * sigma;
+            std::iota(perm, perm + sigma, 0);
+            for (uint32_t k = sigma - 1; k > 0; --k) {  // Fisher-Yates
+                std::swap(perm[k], perm[engine() % (k + 1)]);
+            }
+        }
+    }
+
+    // Keys are within radius of one of num_clusters uniform centers, and queries are the centers
+    void set_cluster(uint64_t num_clusters, int radius) {
+        std::mt19937_64 engine(get_seed_(CENTER_STREAM, 0));
+        m_centers.resize(num_clusters * m_conf.dim);
+        for (auto& c : m_centers) {
+            c = uint8_t(engine() & m_mask);
+        }
+        m_radius = radius;
+    }
+
+    // For each query, num_dups keys are planted at each of the distances, evenly spaced in the keys
+    void set_planted(uint64_t num_keys, const std::vector<const uint8_t*>& queries, const std::vector<int>& dists,
+                     uint64_t num_dups) {
+        m_queries = queries;
+        m_dists = dists;
+        m_num_dups = num_dups;
+        m_num_planted = queries.size() * dists.size() * num_dups;
+        if (num_keys < m_num_planted) {
+            std::cerr << "error: #keys must be >= #planted keys " << m_num_planted << std::endl;
+            exit(1);
+        }
+        m_planted_step = m_num_planted == 0 ? 0 : num_keys / m_num_planted;
+    }
+
+    // Writes keys [beg, end) of the stream into keys
+    void generate(uint64_t stream, uint64_t beg, uint64_t end, uint8_t* keys) const {
+        assert(beg % CHUNK_SIZE == 0);
+        std::mt19937_64 engine(get_seed_(stream, beg / CHUNK_SIZE));
+        for (uint64_t i = beg; i < end; ++i) {
+            uint8_t* key = keys + (i - beg) * m_conf.dim;
+            switch (m_dist_type) {
+                case dist_types::UNIFORM:
+                case dist_types::PLANTED:
+                    gen_uniform_(engine, key);
+                    if (m_dist_type == dist_types::PLANTED and stream == BASE_STREAM) {
+                        plant_(engine, i, key);
+                    }
+                    break;
+                case dist_types::ZIPF:
+                    gen_zipf_(engine, key);
+                    break;
+                case dist_types::CLUSTER:
+                    if (stream == QUERY_STREAM) {
+                        const uint64_t c = i % (m_centers.size() / m_conf.dim);
+                        std::copy_n(m_centers.data() + c * m_conf.dim, m_conf.dim, key);
+                    } else {
+                        const uint64_t c = engine() % (m_centers.size() / m_conf.dim);
+                        std::copy_n(m_centers.data() + c * m_conf.dim, m_conf.dim, key);
+                        mutate_(engine, key, int(engine() % (m_radius + 1)));
+                    }
+                    break;
+            }
+        }
+    }
+
+  private:
+    config_t m_conf;
+    dist_types m_dist_type;
+    uint64_t m_seed;
+    uint32_t m_mask;
+
+    std::vector<double> m_zipf_cdf;
+    std::vector<uint8_t> m_zipf_perms;  // [dim][rank]
+
+    std::vector<uint8_t> m_centers;
+    int m_radius = 0;
+
+    std::vector<const uint8_t*> m_queries;
+    std::vector<int> m_dists;
+    uint64_t m_num_dups = 0;
+    uint64_t m_num_planted = 0;
+    uint64_t m_planted_step = 0;
+
+    uint64_t get_seed_(uint64_t stream, uint64_t chunk) const {
+        return splitmix64(m_seed ^ splitmix64((stream << 48) ^ chunk));
+    }
+
+    // Takes 64 / bits integers from each random word
+    void gen_uniform_(std::mt19937_64& engine, uint8_t* key) const {
+        uint64_t word = 0;
+        int num_left = 0;
+        for (int i = 0; i < m_conf.dim; ++i, --num_left) {
+            if (num_left == 0) {
+                word = engine();
+                num_left = 64 / m_conf.bits;
+            }
+            key[i] = uint8_t(word & m_mask);
+            word >>= m_conf.bits;
+        }
+    }
+
+    void gen_zipf_(std::mt19937_64& engine, uint8_t* key) const {
+        const uint32_t sigma = m_mask + 1;
+        for (int i = 0; i < m_conf.dim; ++i) {
+            const double u = double(engine() >> 11) * 0x1.0p-53;
+            const auto it = std::lower_bound(m_zipf_cdf.begin(), m_zipf_cdf.end(), u);
+            const uint32_t rank = std::min(uint32_t(it - m_zipf_cdf.begin()), sigma - 1);
+            key[i] = m_zipf_perms[size_t(i) * sigma + rank];
+        }
+    }
+
+    // Substitutes the integers at exactly errs distinct positions
+    void mutate_(std::mt19937_64& engine, uint8_t* key, int errs) const {
+        uint64_t used = 0;
+        for (int e = 0; e < errs; ++e) {
+            int pos = int(engine() % m_conf.dim);
+            while (used >> pos & 1ULL) {
+                pos = (pos + 1) % m_conf.dim;
+            }
+            used |= 1ULL << pos;
+            key[pos] = uint8_t((key[pos] + 1 + engine() % m_mask) & m_mask);
+        }
+    }
+
+    void plant_(std::mt19937_64& engine, uint64_t id, uint8_t* key) const {
+        if (m_planted_step == 0 or id % m_planted_step != 0 or m_num_planted <= id / m_planted_step) {
+            return;
+        }
+        const uint64_t j = id / m_planted_step;
+        const uint64_t q = j / (m_dists.size() * m_num_dups);
+        const int dist = m_dists[j / m_num_dups % m_dists.size()];
+        std::copy_n(m_queries[q], m_conf.dim, key);
+        mutate_(engine, key, dist);
+    }
+};
+
+// Generates num_keys keys of the stream with threads and streams them into fn in bvecs format
+void write_bvecs(const sketch_generator& gen, uint64_t stream, uint64_t num_keys, const config_t& conf,
+                 const std::string& fn, std::vector<uint8_t>* kept = nullptr) {
+    std::ofstream ofs(fn);
+    if (!ofs) {
+        std::cerr << "open error: " << fn << std::endl;
+        exit(1);
+    }
+
+    const size_t num_chunks = (num_keys + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const size_t batch_chunks = std::max(conf.threads, 1) * CHUNKS_PER_THREAD;
+    const uint32_t dim = uint32_t(conf.dim);
+
+    std::vector<uint8_t> keys(batch_chunks * CHUNK_SIZE * dim);
+    std::vector<char> buf;
+
+    for (size_t batch_beg = 0; batch_beg < num_chunks; batch_beg += batch_chunks) {
+        const size_t batch_end = std::min(batch_beg + batch_chunks, num_chunks);
+        parallel_for(batch_end - batch_beg, conf.threads, [&](size_t c) {
+            const uint64_t beg = (batch_beg + c) * CHUNK_SIZE;
+            const uint64_t end = std::min<uint64_t>(beg + CHUNK_SIZE, num_keys);
+            gen.generate(stream, beg, end, keys.data() + c * CHUNK_SIZE * dim);
+        });
+
+        const uint64_t num = std::min<uint64_t>(batch_end * CHUNK_SIZE, num_keys) - batch_beg * CHUNK_SIZE;
+        buf.resize(num * (sizeof(uint32_t) + dim));
+        for (uint64_t i = 0; i < num; ++i) {
+            char* rec = buf.data() + i * (sizeof(uint32_t) + dim);
+            std::memcpy(rec, &dim, sizeof(uint32_t));
+            std::memcpy(rec + sizeof(uint32_t), keys.data() + i * dim, dim);
+        }
+        ofs.write(buf.data(), buf.size());
+
+        if (kept != nullptr) {
+            kept->insert(kept->end(), keys.begin(), keys.begin() + num * dim);
+        }
+    }
+
+    std::cout << "--> " << num_keys << " keys to " << fn << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::ios::sync_with_stdio(false);
+
+    cmdline::parser p;
+    p.add<std::string>("base_fn", 'd', "output file name of database sketches in bvecs format", true);
+    p.add<std::string>("query_fn", 'q', "output file name of query sketches in bvecs format", false, "");
+    p.add<uint64_t>("num_keys", 'N', "#database sketches", false, 1000000);
+    p.add<uint64_t>("num_queries", 'Q', "#query sketches", false, 1000);
+    p.add<int>("dim", 'm', "dimension (<= 64)", false, 32);
+    p.add<int>("bits", 'b', "#bits of alphabet (<= 8)", false, 2);
+    p.add<std::string>("dist", 'k', "distribution (uniform | zipf | cluster | planted)", false, "uniform");
+    p.add<double>("zipf", 'z', "exponent of Zipf distribution", false, 1.0);
+    p.add<uint64_t>("clusters", 'c', "#clusters, whose centers are the queries", false, 1000);
+    p.add<int>("radius", 'r', "max distance of keys from the center of their cluster", false, 2);
+    p.add<std::string>("dists", 'e', "distances of planted keys from a query (comma separated)", false, "1,2,3");
+    p.add<uint64_t>("dups", 'D', "#planted keys per query and distance", false, 1);
+    p.add<uint64_t>("seed", 'S', "seed", false, 13);
+    p.add<int>("threads", 'T', "#threads", false, int(std::thread::hardware_concurrency()));
+    p.parse_check(argc, argv);
+
+    auto base_fn = p.get<std::string>("base_fn");
+    auto query_fn = p.get<std::string>("query_fn");
+    auto num_keys = p.get<uint64_t>("num_keys");
+    auto num_queries = p.get<uint64_t>("num_queries");
+    auto dist = p.get<std::string>("dist");
+
+    config_t conf;
+    conf.dim = p.get<int>("dim");
+    conf.bits = p.get<int>("bits");
+    conf.threads = p.get<int>("threads");
+
+    if (conf.dim < 1 or 64 < conf.dim) {
+        std::cerr << "error: dim must be in [1, 64]" << std::endl;
+        return 1;
+    }
+    if (conf.bits < 1 or 8 < conf.bits) {
+        std::cerr << "error: bits must be in [1, 8]" << std::endl;
+        return 1;
+    }
+    if (UINT32_MAX < num_keys) {
+        std::cerr << "error: #keys must be < 2^32 since IDs are 32 bits" << std::endl;
+        return 1;
+    }
+
+    dist_types dist_type;
+    if (dist == "uniform") {
+        dist_type = dist_types::UNIFORM;
+    } else if (dist == "zipf") {
+        dist_type = dist_types::ZIPF;
+    } else if (dist == "cluster") {
+        dist_type = dist_types::CLUSTER;
+    } else if (dist == "planted") {
+        dist_type = dist_types::PLANTED;
+    } else {
+        std::cerr << "error: invalid dist " << dist << std::endl;
+        return 1;
+    }
+
+    sketch_generator gen(conf, dist_type, p.get<uint64_t>("seed"));
+    std::vector<uint8_t> queries_buf;
+
+    switch (dist_type) {
+        case dist_types::ZIPF:
+            gen.set_zipf(p.get<double>("zipf"));
+            break;
+        case dist_types::CLUSTER: {
+            const auto num_clusters = p.get<uint64_t>("clusters");
+            const auto radius = p.get<int>("radius");
+            if (num_clusters == 0 or radius < 0 or conf.dim < radius) {
+                std::cerr << "error: clusters must be > 0 and radius in [0, dim]" << std::endl;
+                return 1;
+            }
+            gen.set_cluster(num_clusters, radius);
+            std::cout << "--> " << num_keys / num_clusters << " keys per cluster on average" << std::endl;
+            break;
+        }
+        case dist_types::PLANTED: {
+            std::vector<int> dists;
+            std::istringstream iss(p.get<std::string>("dists"));
+            for (std::string s; std::getline(iss, s, ',');) {
+                dists.push_back(std::stoi(s));
+                if (dists.back() < 0 or conf.dim < dists.back()) {
+                    std::cerr << "error: dists must be in [0, dim]" << std::endl;
+                    return 1;
+                }
+            }
+            if (query_fn.empty()) {
+                std::cerr << "error: planted keys need query_fn" << std::endl;
+                return 1;
+            }
+            // The queries are needed to plant the keys, so they are generated first
+            write_bvecs(gen, QUERY_STREAM, num_queries, conf, query_fn, &queries_buf);
+            query_fn.clear();
+            gen.set_planted(num_keys, extract_ptrs(queries_buf, conf), dists, p.get<uint64_t>("dups"));
+            break;
+        }
+        default:
+            break;
+    }
+
+    if (!query_fn.empty()) {
+        write_bvecs(gen, QUERY_STREAM, num_queries, conf, query_fn);
+    }
+    write_bvecs(gen, BASE_STREAM, num_keys, conf, base_fn);
+
+    return 0;
+}
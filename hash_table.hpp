@@ -1,17 +1,26 @@
 #pragma once
 
+#include <type_traits>
+
+#include "ctrl_group.hpp"
 #include "misc.hpp"
 #include "sig_generator.hpp"
 #include "sig_size.hpp"
+#include "tab_hash.hpp"
 
 namespace sketch_search {
 
 static constexpr size_t SIG_LIMIT = 100000000;  // 100M
 
+// Cost of scanning one word of packed keys relative to probing one signature
+static constexpr double SCAN_WORD_COST = 0.05;
+
 class hash_table {
+  private:
+    struct element_t;
+
   public:
     using size_type = uint64_t;
-    static constexpr double load_factor = 1.5;
 
     hash_table() = default;
     ~hash_table() = default;
@@ -27,58 +36,244 @@ class hash_table {
 
         const std::vector<score_t>& operator()(const uint8_t* q, int max_errs, stat_t& stat) {
             m_score.clear();
+            (*this)(q, max_errs, stat, [&](uint32_t id, int errs) {
+                m_score.push_back({id, errs});
+                return true;
+            });
+            return m_score;
+        }
+
+        // Calls visit(id, errs) for each answer as soon as it is found, without materializing the answers.
+        // The search stops once visit returns false, and then false is returned.
+        template <class Visitor>
+        bool operator()(const uint8_t* q, int max_errs, stat_t& stat, Visitor&& visit) {
             if (max_errs < 0) {
-                return m_score;
+                return true;
+            }
+
+            const int dim = m_obj->m_conf.dim;
+            const int bits = m_obj->m_conf.bits;
+            const int words = m_obj->m_words;
+
+            // No key is farther than dim, and the signature generator supports errs up to dim
+            max_errs = std::min(max_errs, dim);
+
+            m_q = q;
+            m_max_errs = max_errs;
+            to_packed_code(q, bits, dim, m_base_pq);
+
+            // If probing the signatures will be slower than plain linear scan, then we scan the keys.
+            // The signature count also bounds the prefix-filtered enumeration.
+            if (m_obj->prefers_scan_(max_errs)) {
+                ++stat.num_scanned;
+                return scan_(visit);
             }
 
-            // If # of signatures exceeds # of keys, then we stop the query process
-            // because the running time will be slower than that of plain linear scan
-            if (get_sigsize(m_obj->m_conf.bits, m_obj->m_conf.dim, max_errs) >= SIG_LIMIT) {
-                std::cerr << "**** forced termination due to massive signatures!! ****" << std::endl;
-                exit(1);
+            if (m_obj->has_pfx_filter()) {
+                std::copy(m_base_pq, m_base_pq + words, m_pq);
+                const bool done = dfs_(0, 0, 0, visit) and flush_(visit);
+                ++stat.num_hashed;
+                return done;
             }
 
+            const auto& hasher = m_obj->m_hasher;
+            const uint64_t base_hash = hasher(q, dim);
+
             for (int errs = 0; errs <= max_errs; ++errs) {
-                m_gen.set(q, m_obj->m_conf.dim, m_obj->m_conf.dim, m_obj->m_conf.bits, errs);
+                uint64_t hash = base_hash;
+                std::copy(m_base_pq, m_base_pq + words, m_pq);
+
+                m_gen.set(q, dim, dim, bits, errs);
                 while (m_gen.has_next()) {
-                    m_q = m_gen.next();
-                    find_(errs);
+                    m_gen.next();
+
+                    // Only the positions changed from the previous signature are rehashed and repacked
+                    const sig_generator::delta_t* deltas = m_gen.get_deltas();
+                    for (int r = 0; r < m_gen.get_num_deltas(); ++r) {
+                        const auto& d = deltas[r];
+                        hash = hasher.update(hash, d.pos, d.c_old, d.c_new);
+                        update_packed_code(m_pq, bits, d.pos, d.c_old, d.c_new);
+                    }
+                    if (!push_(hash, errs, visit)) {
+                        ++stat.num_hashed;
+                        return false;
+                    }
                 }
             }
-            return m_score;
+            ++stat.num_hashed;
+            return flush_(visit);
+        }
+
+        // Returns the number of answers, adding the #IDs of each matched element without reading the IDs
+        uint64_t count(const uint8_t* q, int max_errs, stat_t& stat) {
+            id_counter counter;
+            (*this)(q, max_errs, stat, counter);
+            return counter.num;
         }
 
       private:
+        // Signatures are probed in batches. While a batch is filled, the first groups of the signatures
+        // are prefetched, so the cache misses of a batch overlap each other.
+        static constexpr int BATCH_SIZE = 16;
+
+        struct probe_t {
+            uint64_t hash;
+            int errs;
+            uint64_t pq[MAX_WORDS];  // in packed code
+        };
+
         const hash_table* m_obj = nullptr;
         const uint8_t* m_q = nullptr;
+        int m_max_errs = 0;
+        uint64_t m_base_pq[MAX_WORDS];
+        uint64_t m_pq[MAX_WORDS];  // of the current signature
         sig_generator m_gen;
+        probe_t m_batch[BATCH_SIZE];
+        int m_batch_size = 0;
         std::vector<score_t> m_score;
 
         searcher(const hash_table* obj) : m_obj(obj) {
             m_score.reserve(1U << 10);
         }
 
-        void find_(int errs) {
-            size_t pos = fnv1a_hash_(m_q, m_obj->m_conf.dim) % m_obj->m_table.size();
+        // Enumerates the signatures in depth-first order of positions, where pfx_hash is the hash of
+        // the first h integers. Subtrees whose prefixes do not exist in the database are pruned.
+        // The probing functions return false if visit stopped the search.
+        template <class Visitor>
+        bool dfs_(int h, int errs, uint64_t pfx_hash, Visitor& visit) {
+            const int dim = m_obj->m_conf.dim;
+            if (h == dim) {
+                return push_(pfx_hash, errs, visit);
+            }
 
-            // Linear probing
-            while (true) {
-                if (m_obj->m_table[pos].key_pos == UINT32_MAX) {
-                    break;
+            const auto& hasher = m_obj->m_hasher;
+            const uint8_t c = m_q[h];
+
+            {
+                uint64_t next_hash = pfx_hash ^ hasher.get(h, c);
+                if ((h + 1 == dim or m_obj->pfx_exists_(h + 1, m_pq[0], next_hash)) and
+                    !dfs_(h + 1, errs, next_hash, visit)) {
+                    return false;
                 }
+            }
+            if (errs == m_max_errs) {
+                return true;
+            }
+
+            const int bits = m_obj->m_conf.bits;
+            for (int i = 0; i < (1 << bits); ++i) {
+                if (i == c) {
+                    continue;
+                }
+                update_packed_code(m_pq, bits, h, c, uint8_t(i));
+                uint64_t next_hash = pfx_hash ^ hasher.get(h, uint8_t(i));
+                if ((h + 1 == dim or m_obj->pfx_exists_(h + 1, m_pq[0], next_hash)) and
+                    !dfs_(h + 1, errs + 1, next_hash, visit)) {
+                    update_packed_code(m_pq, bits, h, uint8_t(i), c);
+                    return false;
+                }
+                update_packed_code(m_pq, bits, h, uint8_t(i), c);
+            }
+            return true;
+        }
+
+        template <class Visitor>
+        bool push_(uint64_t hash, int errs, Visitor& visit) {
+            probe_t& probe = m_batch[m_batch_size++];
+            probe.hash = hash;
+            probe.errs = errs;
+            std::copy(m_pq, m_pq + m_obj->m_words, probe.pq);
+
+            const size_t slot_beg = ctrl_group::get_group(hash, m_obj->num_groups_()) * ctrl_group::SIZE;
+            __builtin_prefetch(m_obj->m_ctrls.data() + slot_beg);
+            __builtin_prefetch(m_obj->m_table.data() + slot_beg);
+
+            return m_batch_size < BATCH_SIZE or flush_(visit);
+        }
+
+        template <class Visitor>
+        bool flush_(Visitor& visit) {
+            const int batch_size = m_batch_size;
+            m_batch_size = 0;
+            for (int i = 0; i < batch_size; ++i) {
+                if (!find_(m_batch[i], visit)) {
+                    return false;
+                }
+            }
+            return true;
+        }
 
-                auto key = m_obj->m_keys.begin() + (m_obj->m_table[pos].key_pos * m_obj->m_conf.dim);
-                if (std::equal(m_q, m_q + m_obj->m_conf.dim, key)) {
-                    for (uint32_t i = m_obj->m_table[pos].id_beg; i < m_obj->m_table[pos].id_end; ++i) {
-                        m_score.push_back({static_cast<uint32_t>(m_obj->m_ids[i]), errs});
+        template <class Visitor>
+        bool find_(const probe_t& probe, Visitor& visit) {
+            const uint8_t tag = ctrl_group::get_tag(probe.hash);
+            const uint32_t fprint = get_fprint_(probe.hash);
+            const size_t num_groups = m_obj->num_groups_();
+            const int words = m_obj->m_words;
+
+            // Probing by groups
+            for (size_t g = ctrl_group::get_group(probe.hash, num_groups);;) {
+                const size_t slot_beg = g * ctrl_group::SIZE;
+                const uint8_t* ctrls = m_obj->m_ctrls.data() + slot_beg;
+
+                for (uint32_t match = ctrl_group::match(ctrls, tag); match != 0; match &= match - 1) {
+                    const element_t& elem = m_obj->m_table[slot_beg + __builtin_ctz(match)];
+                    if (elem.fprint != fprint) {
+                        continue;
                     }
-                    return;
+                    const uint64_t* key = m_obj->m_keys.data() + elem.key_pos * size_t(words);
+                    if (std::equal(probe.pq, probe.pq + words, key)) {
+                        return push_ids_(elem, probe.errs, visit);
+                    }
+                }
+                if (ctrl_group::match_empty(ctrls) != 0) {
+                    return true;
+                }
+                if (++g == num_groups) {
+                    g = 0;
                 }
-                ++pos;
-                if (pos == m_obj->m_table.size()) {
-                    pos = 0;
+            }
+        }
+
+        // Since the keys are stored in the order of the occupied slots, both are read sequentially
+        template <class Visitor>
+        bool scan_(Visitor& visit) {
+            const int bits = m_obj->m_conf.bits;
+            const int words = m_obj->m_words;
+            const size_t num_slots = m_obj->m_ctrls.size();
+
+            uint64_t heads[MAX_WORDS];
+            get_packed_heads(bits, m_obj->m_conf.dim, heads);
+
+            const uint64_t* key = m_obj->m_keys.data();
+            for (size_t slot_beg = 0; slot_beg < num_slots; slot_beg += ctrl_group::SIZE) {
+                const uint8_t* ctrls = m_obj->m_ctrls.data() + slot_beg;
+                uint32_t occupied = ~ctrl_group::match_empty(ctrls) & ((1U << ctrl_group::SIZE) - 1);
+                for (; occupied != 0; occupied &= occupied - 1, key += words) {
+                    const int errs = get_hamdist_p(m_base_pq, key, heads, bits, words, m_max_errs);
+                    if (errs <= m_max_errs and
+                        !push_ids_(m_obj->m_table[slot_beg + __builtin_ctz(occupied)], errs, visit)) {
+                        return false;
+                    }
                 }
             }
+            return true;
+        }
+
+        template <class Visitor>
+        bool push_ids_(const element_t& elem, int errs, Visitor& visit) {
+            if constexpr (std::is_same<Visitor, id_counter>::value) {
+                visit.num += elem.id_num;
+                return true;
+            }
+            if (elem.id_num == 1) {
+                return visit(elem.id_beg, errs);
+            }
+            for (uint32_t i = elem.id_beg; i < elem.id_beg + elem.id_num; ++i) {
+                if (!visit(static_cast<uint32_t>(m_obj->m_ids[i]), errs)) {
+                    return false;
+                }
+            }
+            return true;
         }
 
         friend class hash_table;
@@ -89,30 +284,52 @@ class hash_table {
     }
 
     uint64_t num_keys() const {
-        return m_ids.size();
+        return m_num_keys;
     }
     config_t get_config() const {
         return m_conf;
     }
 
-    void show_stats(std::ostream& os) const {}
+    bool has_pfx_filter() const {
+        return !m_pfx_levels.empty();
+    }
+
+    void show_stats(std::ostream& os) const {
+        if (has_pfx_filter()) {
+            os << "Statistics of hash_table\n";
+            os << "--> pfx_filter: " << m_pfx_bits.size() << " bits; " << m_pfx_levels.size() << " levels" << std::endl;
+        }
+    }
+
+    void write_shape_csv(std::ostream&, int) const {}  // no trie
 
     size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
         auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
         size_type written_bytes = 0;
         written_bytes += sdsl::serialize(m_conf, out, child, "m_conf");
+        written_bytes += sdsl::serialize(m_num_keys, out, child, "m_num_keys");
+        written_bytes += sdsl::serialize(m_ctrls, out, child, "m_ctrls");
         written_bytes += sdsl::serialize(m_table, out, child, "m_table");
+        written_bytes += sdsl::serialize(m_words, out, child, "m_words");
         written_bytes += sdsl::serialize(m_keys, out, child, "m_keys");
         written_bytes += sdsl::serialize(m_ids, out, child, "m_ids");
+        written_bytes += sdsl::serialize(m_pfx_levels, out, child, "m_pfx_levels");
+        written_bytes += sdsl::serialize(m_pfx_bits, out, child, "m_pfx_bits");
         sdsl::structure_tree::add_size(child, written_bytes);
         return written_bytes;
     }
 
     void load(std::istream& in) {
-        sdsl::load(m_conf, in);
+        load_config(m_conf, in);
+        sdsl::load(m_num_keys, in);
+        sdsl::load(m_ctrls, in);
         sdsl::load(m_table, in);
+        sdsl::load(m_words, in);
         sdsl::load(m_keys, in);
         sdsl::load(m_ids, in);
+        sdsl::load(m_pfx_levels, in);
+        sdsl::load(m_pfx_bits, in);
+        m_hasher.build(m_conf.dim, m_conf.bits);
     }
 
     hash_table(const hash_table&) = delete;
@@ -124,67 +341,192 @@ class hash_table {
     hash_table& operator=(hash_table&& rhs) noexcept {
         if (this != &rhs) {
             m_conf = std::move(rhs.m_conf);
+            m_num_keys = std::move(rhs.m_num_keys);
+            m_ctrls = std::move(rhs.m_ctrls);
             m_table = std::move(rhs.m_table);
+            m_words = std::move(rhs.m_words);
             m_keys = std::move(rhs.m_keys);
             m_ids = std::move(rhs.m_ids);
+            m_hasher = std::move(rhs.m_hasher);
+            m_pfx_levels = std::move(rhs.m_pfx_levels);
+            m_pfx_bits = std::move(rhs.m_pfx_bits);
         }
         return *this;
     }
 
   private:
+    // #bits per prefix in the hashed levels of the prefix filter
+    static constexpr uint64_t PFX_BITS_PER_NODE = 8;
+
     struct element_t {
+        uint32_t fprint;  // upper bits of the hash
         uint32_t key_pos;
-        uint32_t id_beg;
-        uint32_t id_end;
+        uint32_t id_beg;  // the ID itself if id_num == 1
+        uint32_t id_num;
     };
     config_t m_conf;
+    uint64_t m_num_keys = 0;
+    std::vector<uint8_t> m_ctrls;  // in groups of ctrl_group::SIZE
     std::vector<element_t> m_table;
-    sdsl::int_vector<> m_keys;
-    sdsl::int_vector<> m_ids;
+    int m_words = 0;  // per key
+    std::vector<uint64_t> m_keys;  // in packed codes
+    sdsl::int_vector<> m_ids;  // except singletons
+    tab_hash m_hasher;  // not serialized since it is determined by dim and bits
+
+    // Prefix filter: for each prefix length, a bitmap addressed by the packed prefix (if small enough)
+    // or a Bloom filter with one hash function addressed by the prefix hash
+    struct pfx_level_t {
+        uint64_t begin;  // in m_pfx_bits
+        uint32_t lg_size;  // log2 of #bits
+        uint32_t direct;
+    };
+    std::vector<pfx_level_t> m_pfx_levels;  // for prefix lengths 1, ..., dim - 1
+    sdsl::bit_vector m_pfx_bits;
+
+    size_t num_groups_() const {
+        return m_ctrls.size() / ctrl_group::SIZE;
+    }
+
+    // Estimates the costs of both the query processes from the number of signatures
+    // (SIGSIZE has no signatures beyond dim, so max_errs is clamped to dim)
+    bool prefers_scan_(int max_errs) const {
+        const uint64_t num_sigs = get_sigsize(m_conf.bits, m_conf.dim, std::min(max_errs, m_conf.dim));
+        if (num_sigs >= SIG_LIMIT) {
+            return true;
+        }
+        return double(m_keys.size()) * SCAN_WORD_COST < double(num_sigs);
+    }
+
+    // pq0 is the first word of the packed code and pfx_hash is the hash of the prefix
+    bool pfx_exists_(int len, uint64_t pq0, uint64_t pfx_hash) const {
+        const pfx_level_t& level = m_pfx_levels[len - 1];
+        uint64_t i = level.direct ? (pq0 & get_max_value<uint64_t>(level.lg_size)) : (pfx_hash >> (64 - level.lg_size));
+        return m_pfx_bits[level.begin + i];
+    }
+
+    void build_pfx_filter_(const std::vector<entry_t>& entries) {
+        const int dim = m_conf.dim;
+        const int bits = m_conf.bits;
+
+        // #nodes at level len = 1 + #{adjacent entries whose LCP is less than len}
+        std::vector<uint64_t> num_nodes(dim + 1, 1);
+        for (size_t i = 1; i < entries.size(); ++i) {
+            int lcp = 0;
+            while (entries[i - 1].key[lcp] == entries[i].key[lcp]) {
+                ++lcp;
+            }
+            for (int len = lcp + 1; len <= dim; ++len) {
+                ++num_nodes[len];
+            }
+        }
+
+        uint64_t num_bits = 0;
+        for (int len = 1; len < dim; ++len) {
+            const uint32_t lg_hashed = std::max(6U, sdsl::bits::hi(num_nodes[len] * PFX_BITS_PER_NODE - 1) + 1);
+            const uint32_t lg_direct = uint32_t(len * bits);
+            if (lg_direct <= lg_hashed) {
+                m_pfx_levels.push_back(pfx_level_t{num_bits, lg_direct, 1});
+            } else {
+                m_pfx_levels.push_back(pfx_level_t{num_bits, lg_hashed, 0});
+            }
+            num_bits += 1ULL << m_pfx_levels.back().lg_size;
+        }
+
+        m_pfx_bits = sdsl::bit_vector(num_bits, 0);
+        for (const auto& e : entries) {
+            uint64_t pq0 = 0;
+            uint64_t pfx_hash = 0;
+            for (int len = 1; len < dim; ++len) {
+                const pfx_level_t& level = m_pfx_levels[len - 1];
+                pfx_hash ^= m_hasher.get(len - 1, e.key[len - 1]);
+                if (level.direct) {
+                    pq0 |= uint64_t(e.key[len - 1]) << ((len - 1) * bits);
+                    m_pfx_bits[level.begin + pq0] = 1;
+                } else {
+                    m_pfx_bits[level.begin + (pfx_hash >> (64 - level.lg_size))] = 1;
+                }
+            }
+        }
+    }
 
     void build_(std::vector<const uint8_t*>& keys) {
-        const auto entries = make_entries(keys, m_conf.dim);
-        const size_t num_elems = entries.size() * load_factor;
+        if (m_conf.load_factor <= 0.0 or 1.0 < m_conf.load_factor) {
+            std::cerr << "error: load_factor <= 0.0 or 1.0 < load_factor" << std::endl;
+            exit(1);
+        }
+
+        const auto entries = make_entries(keys, m_conf.dim, m_conf.bits);
+        m_num_keys = keys.size();
+        m_hasher.build(m_conf.dim, m_conf.bits);
 
-        m_table.resize(num_elems, element_t{UINT32_MAX, 0, 0});
-        m_keys = sdsl::int_vector<>(entries.size() * m_conf.dim, 0, m_conf.bits);
-        m_ids = sdsl::int_vector<>(keys.size(), 0, sdsl::bits::hi(keys.size()) + 1);
+        // At least one slot has to be empty to stop probing
+        const size_t num_groups = size_t(entries.size() / m_conf.load_factor) / ctrl_group::SIZE + 1;
+        const size_t num_elems = num_groups * ctrl_group::SIZE;
+
+        m_ctrls.resize(num_elems, ctrl_group::EMPTY);
+        m_table.resize(num_elems, element_t{0, UINT32_MAX, 0, 0});
+        m_words = get_num_words(m_conf.bits, m_conf.dim);
+        m_keys.resize(entries.size() * size_t(m_words));
+
+        size_t num_ids = 0;
+        for (const auto& e : entries) {
+            if (e.ids.size() != 1) {
+                num_ids += e.ids.size();
+            }
+        }
+        m_ids = sdsl::int_vector<>(num_ids, 0, sdsl::bits::hi(keys.size()) + 1);
 
         size_t id_beg = 0;
 
         for (size_t i = 0; i < entries.size(); ++i) {
             const auto& e = entries[i];
-            size_t pos = fnv1a_hash_(e.key, m_conf.dim) % num_elems;
-
-            // Linear probing
-            while (m_table[pos].key_pos != UINT32_MAX) {
-                ++pos;
-                if (pos == num_elems) {
-                    pos = 0;
+            const uint64_t hash = m_hasher(e.key, m_conf.dim);
+
+            // Probing by groups
+            size_t pos = 0;
+            for (size_t g = ctrl_group::get_group(hash, num_groups);;) {
+                uint32_t match = ctrl_group::match_empty(m_ctrls.data() + g * ctrl_group::SIZE);
+                if (match != 0) {
+                    pos = g * ctrl_group::SIZE + __builtin_ctz(match);
+                    break;
+                }
+                if (++g == num_groups) {
+                    g = 0;
                 }
             }
 
-            m_table[pos].key_pos = static_cast<uint32_t>(i);
-            std::copy(e.key, e.key + m_conf.dim, m_keys.begin() + (i * m_conf.dim));
-
-            m_table[pos].id_beg = id_beg;
-            for (uint32_t id : e.ids) {
-                m_ids[id_beg++] = id;
+            m_ctrls[pos] = ctrl_group::get_tag(hash);
+            m_table[pos].fprint = get_fprint_(hash);
+            m_table[pos].key_pos = static_cast<uint32_t>(i);  // renumbered below
+
+            m_table[pos].id_num = static_cast<uint32_t>(e.ids.size());
+            if (e.ids.size() == 1) {
+                m_table[pos].id_beg = e.ids[0];
+            } else {
+                m_table[pos].id_beg = id_beg;
+                for (uint32_t id : e.ids) {
+                    m_ids[id_beg++] = id;
+                }
             }
-            m_table[pos].id_end = id_beg;
         }
-    }
 
-    static size_t fnv1a_hash_(const uint8_t* key, size_t length) {
-        static const size_t init = size_t((sizeof(size_t) == 8) ? 0xcbf29ce484222325 : 0x811c9dc5);
-        static const size_t multiplier = size_t((sizeof(size_t) == 8) ? 0x100000001b3 : 0x1000193);
+        // The keys are stored in the order of the occupied slots for linear scan
+        uint32_t key_pos = 0;
+        for (size_t pos = 0; pos < num_elems; ++pos) {
+            if (m_ctrls[pos] != ctrl_group::EMPTY) {
+                to_packed_code(entries[m_table[pos].key_pos].key, m_conf.bits, m_conf.dim,
+                               m_keys.data() + key_pos * size_t(m_words));
+                m_table[pos].key_pos = key_pos++;
+            }
+        }
 
-        size_t hash = init;
-        for (size_t i = 0; i < length; ++i) {
-            hash ^= key[i];
-            hash *= multiplier;
+        if (m_conf.pfx_filter) {
+            build_pfx_filter_(entries);
         }
-        return hash;
+    }
+
+    static uint32_t get_fprint_(uint64_t hash) {
+        return uint32_t(hash >> 32);
     }
 };
 
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cmath>
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Log-linear histogram of latencies (or any non-negative integers) in the manner of HdrHistogram.
+// Values less than 2^SUB_BITS have their own buckets, and each range [2^e, 2^(e+1)) above them is
+// divided into 2^SUB_BITS linear buckets, so a percentile is reported within a relative error of
+// 2^-SUB_BITS. Recording a value is a few instructions.
+class latency_histogram {
+  public:
+    static constexpr int SUB_BITS = 6;
+    static constexpr uint64_t SUB_SIZE = 1ULL << SUB_BITS;
+
+    latency_histogram() = default;
+
+    void record(uint64_t value) {
+        const size_t i = get_bucket_(value);
+        if (m_counts.size() <= i) {
+            m_counts.resize(i + 1, 0);
+        }
+        ++m_counts[i];
+        ++m_num_values;
+        m_max = std::max(m_max, value);
+    }
+
+    // Adds the values recorded in rhs, e.g., by another thread
+    void merge(const latency_histogram& rhs) {
+        if (m_counts.size() < rhs.m_counts.size()) {
+            m_counts.resize(rhs.m_counts.size(), 0);
+        }
+        for (size_t i = 0; i < rhs.m_counts.size(); ++i) {
+            m_counts[i] += rhs.m_counts[i];
+        }
+        m_num_values += rhs.m_num_values;
+        m_max = std::max(m_max, rhs.m_max);
+    }
+
+    void clear() {
+        m_counts.clear();
+        m_num_values = 0;
+        m_max = 0;
+    }
+
+    // The value at the given percentile (in [0, 100]), i.e., the highest value equivalent to the bucket
+    uint64_t get_percentile(double percentile) const {
+        if (m_num_values == 0) {
+            return 0;
+        }
+        const double rank = std::max(1.0, std::ceil(m_num_values * percentile / 100.0));
+        uint64_t num = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            num += m_counts[i];
+            if (rank <= double(num)) {
+                return std::min(get_upper_(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t get_max() const {
+        return m_max;
+    }
+    uint64_t get_num_values() const {
+        return m_num_values;
+    }
+
+  private:
+    std::vector<uint64_t> m_counts;
+    uint64_t m_num_values = 0;
+    uint64_t m_max = 0;
+
+    static size_t get_bucket_(uint64_t value) {
+        if (value < SUB_SIZE) {
+            return size_t(value);
+        }
+        const int shift = (63 - __builtin_clzll(value)) - SUB_BITS;
+        return size_t(shift + 1) * SUB_SIZE + ((value >> shift) - SUB_SIZE);
+    }
+
+    static uint64_t get_upper_(size_t i) {
+        if (i < SUB_SIZE) {
+            return i;
+        }
+        const int shift = int(i / SUB_SIZE) - 1;
+        const uint64_t sub = i % SUB_SIZE + SUB_SIZE;
+        return ((sub + 1) << shift) - 1;
+    }
+};
+
+}  // namespace sketch_search
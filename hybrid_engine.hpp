@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cmath>
+#include <variant>
+
+#include "hash_table.hpp"
+#include "sketch_trie.hpp"
+
+namespace sketch_search {
+
+// Single index whose engine (hash_table or sketch_trie) is chosen at build time by a cost model
+// evaluated for the radius conf.errs. Used as the block index of multi_index, each block gets its own
+// engine according to its sub-radius.
+class hybrid_engine {
+  public:
+    using size_type = uint64_t;  // for sdsl
+
+    enum class engine_types : int { HASH = 1, TRIE = 2 };
+
+    // Costs relative to probing a hash signature, fitted to the query times of the hash table and the trie
+    // on news20 sketches (8 to 64 dims of 1 to 4 bits)
+    static constexpr double TRIE_NODE_COST = 0.33;
+    static constexpr double TRIE_CHILD_COST = 0.013;  // for each of the sigma children of a node
+    static constexpr double SUF_CHECK_COST = 0.02;  // Hamming distance of a vertical suffix
+    static constexpr double SCANNED_KEY_COST = 0.1;  // in the scan the hash table falls back to
+
+    hybrid_engine() = default;
+    ~hybrid_engine() = default;
+
+    void build(std::vector<const uint8_t*>& keys, const config_t& conf) {
+        m_conf = conf;
+        estimate_costs_(keys);
+
+        if (m_hash_cost <= m_trie_cost) {
+            m_engine.emplace<hash_table>().build(keys, m_conf);
+        } else {
+            m_engine.emplace<sketch_trie>().build(keys, m_conf);
+        }
+    }
+
+    class searcher {
+      public:
+        searcher() = default;
+
+        const std::vector<score_t>& operator()(const uint8_t* q, int max_errs, stat_t& stat) {
+            return std::visit([&](auto& s) -> const std::vector<score_t>& { return s(q, max_errs, stat); },
+                              m_searcher);
+        }
+
+        template <class Visitor>
+        bool operator()(const uint8_t* q, int max_errs, stat_t& stat, Visitor&& visit) {
+            return std::visit([&](auto& s) { return s(q, max_errs, stat, visit); }, m_searcher);
+        }
+
+        uint64_t count(const uint8_t* q, int max_errs, stat_t& stat) {
+            return std::visit([&](auto& s) { return s.count(q, max_errs, stat); }, m_searcher);
+        }
+
+      private:
+        std::variant<hash_table::searcher, sketch_trie::searcher> m_searcher;
+
+        explicit searcher(const hybrid_engine* obj) {
+            if (obj->get_engine_type() == engine_types::HASH) {
+                m_searcher.emplace<hash_table::searcher>(std::get<hash_table>(obj->m_engine).make_searcher());
+            } else {
+                m_searcher.emplace<sketch_trie::searcher>(std::get<sketch_trie>(obj->m_engine).make_searcher());
+            }
+        }
+
+        friend class hybrid_engine;
+    };  // searcher
+
+    searcher make_searcher() const {
+        return searcher(this);
+    }
+
+    engine_types get_engine_type() const {
+        return std::holds_alternative<hash_table>(m_engine) ? engine_types::HASH : engine_types::TRIE;
+    }
+    std::string get_engine_name() const {
+        return get_engine_type() == engine_types::HASH ? "hash" : "trie";
+    }
+
+    uint64_t num_keys() const {
+        return std::visit([](const auto& e) { return e.num_keys(); }, m_engine);
+    }
+    config_t get_config() const {
+        return m_conf;
+    }
+
+    void show_stats(std::ostream& os) const {
+        os << "Statistics of hybrid_engine\n";
+        os << "--> engine: " << get_engine_name() << '\n';
+        os << "--> dim: " << m_conf.dim << '\n';
+        os << "--> errs: " << m_conf.errs << '\n';
+        os << "--> hash_cost: " << m_hash_cost << '\n';
+        os << "--> trie_cost: " << m_trie_cost << std::endl;
+        std::visit([&](const auto& e) { e.show_stats(os); }, m_engine);
+    }
+
+    void write_shape_csv(std::ostream& os, int block) const {
+        std::visit([&](const auto& e) { e.write_shape_csv(os, block); }, m_engine);
+    }
+
+    size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
+        auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
+        size_type written_bytes = 0;
+        written_bytes += sdsl::serialize(m_conf, out, child, "m_conf");
+        written_bytes += sdsl::serialize(m_hash_cost, out, child, "m_hash_cost");
+        written_bytes += sdsl::serialize(m_trie_cost, out, child, "m_trie_cost");
+        written_bytes += sdsl::serialize(get_engine_type(), out, child, "m_engine_type");
+        written_bytes += std::visit([&](const auto& e) { return sdsl::serialize(e, out, child, "m_engine"); }, m_engine);
+        sdsl::structure_tree::add_size(child, written_bytes);
+        return written_bytes;
+    }
+
+    void load(std::istream& in) {
+        engine_types engine_type;
+        load_config(m_conf, in);
+        sdsl::load(m_hash_cost, in);
+        sdsl::load(m_trie_cost, in);
+        sdsl::load(engine_type, in);
+        if (engine_type == engine_types::HASH) {
+            sdsl::load(m_engine.emplace<hash_table>(), in);
+        } else {
+            sdsl::load(m_engine.emplace<sketch_trie>(), in);
+        }
+    }
+
+    hybrid_engine(const hybrid_engine&) = delete;
+    hybrid_engine& operator=(const hybrid_engine&) = delete;
+
+    hybrid_engine(hybrid_engine&& rhs) noexcept : hybrid_engine() {
+        *this = std::move(rhs);
+    }
+    hybrid_engine& operator=(hybrid_engine&& rhs) noexcept {
+        if (this != &rhs) {
+            m_conf = std::move(rhs.m_conf);
+            m_hash_cost = std::move(rhs.m_hash_cost);
+            m_trie_cost = std::move(rhs.m_trie_cost);
+            m_engine = std::move(rhs.m_engine);
+        }
+        return *this;
+    }
+
+  private:
+    config_t m_conf;
+    double m_hash_cost = 0.0;
+    double m_trie_cost = 0.0;
+    std::variant<hash_table, sketch_trie> m_engine;
+
+    // The hash engine probes all the signatures within errs, or scans the keys if the hash table judges it
+    // cheaper. The trie visits the nodes whose prefixes are within errs down to its height, assuming that
+    // the integers of a prefix are uniform, and then checks the suffixes below the visited nodes.
+    void estimate_costs_(const std::vector<const uint8_t*>& keys) {
+        const int errs = std::min(m_conf.errs, m_conf.dim);
+        if (errs < 0) {
+            m_hash_cost = m_trie_cost = 0.0;
+            return;
+        }
+
+        const auto entries = make_entries(keys, m_conf.dim, m_conf.bits);
+        const auto node_begs = parse_trie(entries, m_conf.dim);
+
+        const double num_words = double(entries.size()) * get_num_words(m_conf.bits, m_conf.dim);
+        const double num_sigs = get_sigsize(m_conf.bits, m_conf.dim, errs);
+        if (SIG_LIMIT <= num_sigs or num_words * SCAN_WORD_COST < num_sigs) {  // as in hash_table
+            m_hash_cost = entries.size() * SCANNED_KEY_COST;
+        } else {
+            m_hash_cost = num_sigs;
+        }
+
+        const int trie_height = sketch_trie::get_trie_height(node_begs, m_conf.bits, m_conf.suf_thr);
+        const double node_cost = TRIE_NODE_COST + TRIE_CHILD_COST * (1 << m_conf.bits);
+        m_trie_cost = 0.0;
+        for (int h = 1; h <= trie_height; ++h) {
+            const double num_nodes = node_begs[h].size() - 1;
+            m_trie_cost += num_nodes * get_ball_ratio_(m_conf.bits, h, errs) * node_cost;
+        }
+        if (trie_height < m_conf.dim) {
+            m_trie_cost += entries.size() * get_ball_ratio_(m_conf.bits, trie_height, errs) * SUF_CHECK_COST;
+        }
+    }
+
+    // Probability that a uniformly random string of len integers is within errs of a given one
+    static double get_ball_ratio_(int bits, int len, int errs) {
+        const double sigma = double(1 << bits);
+        double prob = std::pow(1.0 / sigma, len);  // of exactly k errs, from k = 0
+        double sum = 0.0;
+        for (int k = 0; k <= std::min(errs, len); ++k) {
+            sum += prob;
+            prob *= double(len - k) / (k + 1) * (sigma - 1.0);
+        }
+        return std::min(sum, 1.0);
+    }
+};
+
+}  // namespace sketch_search
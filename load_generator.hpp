@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <random>
+
+#include "histogram.hpp"
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Open-loop load generator that issues the queries at scheduled arrival times (constant or Poisson
+// arrivals at an offered rate) to a pool of worker threads with their own searchers, regardless of how
+// fast the answers come back. The response time of a request is measured from its scheduled arrival,
+// so it includes the queueing delay when the workers fall behind.
+class load_generator {
+  public:
+    enum class arrivals : int { CONSTANT, POISSON };
+
+    static constexpr uint64_t SPIN_NS = 50000;  // sleeps until this much before an arrival, then spins
+
+    struct result_t {
+        double offered_qps = 0.0;
+        double achieved_qps = 0.0;
+        latency_histogram hist;  // response times in ns
+        latency_histogram lag_hist;  // delays in ns of waking up for requests arriving at idle workers
+    };
+
+    load_generator(arrivals arrival, int workers, uint64_t num_requests, uint64_t seed = 13)
+        : m_arrival(arrival), m_workers(std::max(workers, 1)), m_num_requests(num_requests), m_seed(seed) {}
+
+    // Sends num_requests queries (cycling through non-empty queries) within errs at the offered rate (> 0)
+    template <class Index>
+    result_t run(const Index& index, const std::vector<const uint8_t*>& queries, int errs, double qps) const {
+        using hrc = std::chrono::high_resolution_clock;
+
+        assert(!queries.empty() and 0.0 < qps);
+
+        const auto arrival_ns = make_arrivals_(qps);
+        std::vector<latency_histogram> hists(m_workers);
+        std::vector<latency_histogram> lag_hists(m_workers);
+        std::vector<int64_t> last_done_ns(m_workers, 0);  // of each worker from the start
+        std::atomic<uint64_t> next_request{0};
+
+        const auto start = hrc::now() + std::chrono::milliseconds(1);  // lets all the workers get ready
+
+        auto work = [&](int w) {
+            auto searcher = index.make_searcher();
+            stat_t stat;
+            for (uint64_t i = next_request++; i < m_num_requests; i = next_request++) {
+                const auto arrival = start + std::chrono::nanoseconds(arrival_ns[i]);
+                if (hrc::now() < arrival) {  // idle
+                    wait_until_(arrival);
+                    lag_hists[w].record(
+                        uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(hrc::now() - arrival).count()));
+                }
+                searcher(queries[i % queries.size()], errs, stat);
+                const auto done = hrc::now();
+                hists[w].record(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(done - arrival).count()));
+                last_done_ns[w] = std::chrono::duration_cast<std::chrono::nanoseconds>(done - start).count();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int w = 0; w < m_workers; ++w) {
+            threads.emplace_back(work, w);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        result_t ret;
+        ret.offered_qps = qps;
+        const int64_t elapsed_ns = *std::max_element(last_done_ns.begin(), last_done_ns.end());
+        ret.achieved_qps = elapsed_ns == 0 ? 0.0 : m_num_requests / (elapsed_ns / 1e9);
+        for (int w = 0; w < m_workers; ++w) {
+            ret.hist.merge(hists[w]);
+            ret.lag_hist.merge(lag_hists[w]);
+        }
+        return ret;
+    }
+
+  private:
+    arrivals m_arrival;
+    int m_workers;
+    uint64_t m_num_requests;
+    uint64_t m_seed;
+
+    // Arrival times in ns from the start
+    std::vector<uint64_t> make_arrivals_(double qps) const {
+        std::vector<uint64_t> times(m_num_requests);
+        const double interval_ns = 1e9 / qps;
+        std::mt19937_64 engine(m_seed);
+        std::exponential_distribution<double> exp_dist(1.0 / interval_ns);
+        double t = 0.0;
+        for (uint64_t i = 0; i < m_num_requests; ++i) {
+            times[i] = uint64_t(t);
+            t += m_arrival == arrivals::CONSTANT ? interval_ns : exp_dist(engine);
+        }
+        return times;
+    }
+
+    template <class TimePoint>
+    static void wait_until_(const TimePoint& tp) {
+        using hrc = std::chrono::high_resolution_clock;
+        if (hrc::now() + std::chrono::nanoseconds(SPIN_NS) < tp) {
+            std::this_thread::sleep_until(tp - std::chrono::nanoseconds(SPIN_NS));
+        }
+        while (hrc::now() < tp) {
+            std::this_thread::yield();
+        }
+    }
+};
+
+}  // namespace sketch_search
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <iomanip>
+#include <tuple>
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Breakdown of the serialized bytes of an index by components, built on sdsl::structure_tree.
+// Since every size is the number of bytes written by serialize(), the components sum up exactly to the
+// index file. Children with the same name and type (e.g., elements of a vector) are merged by sdsl.
+class memory_report {
+  public:
+    template <class Index>
+    explicit memory_report(const Index& index) : m_root("index", sdsl::util::class_name(index)) {
+        sdsl::nullstream ns;
+        m_num_keys = index.num_keys();
+        m_total_bytes = index.serialize(ns, &m_root, "index");
+    }
+
+    uint64_t get_total_bytes() const {
+        return m_total_bytes;
+    }
+
+    void write_json(std::ostream& os) const {
+        os << "{\"num_keys\": " << m_num_keys << ", \"total_bytes\": " << m_total_bytes << ", \"root\": ";
+        write_json_(os, get_index_node_(), 0);
+        os << "}" << std::endl;
+    }
+
+    // Indented tree of bytes, share of the total, and bits per key
+    void write_table(std::ostream& os) const {
+        os << std::left << std::setw(48) << "component" << std::right << std::setw(14) << "bytes" << std::setw(9)
+           << "%" << std::setw(14) << "bits/key" << '\n';
+        write_table_(os, get_index_node_(), 0);
+        os << std::flush;
+    }
+
+  private:
+    sdsl::structure_tree_node m_root;
+    uint64_t m_num_keys = 0;
+    uint64_t m_total_bytes = 0;
+
+    const sdsl::structure_tree_node* get_index_node_() const {
+        return m_root.children.begin()->second.get();
+    }
+
+    // Children sorted by name since sdsl keeps them in a hash map
+    static std::vector<const sdsl::structure_tree_node*> get_children_(const sdsl::structure_tree_node* v) {
+        std::vector<const sdsl::structure_tree_node*> children;
+        for (const auto& kv : v->children) {
+            children.push_back(kv.second.get());
+        }
+        std::sort(children.begin(), children.end(), [](auto lhs, auto rhs) {
+            return std::tie(lhs->name, lhs->type) < std::tie(rhs->name, rhs->type);
+        });
+        return children;
+    }
+
+    double get_bits_per_key_(uint64_t bytes) const {
+        return m_num_keys == 0 ? 0.0 : bytes * 8.0 / m_num_keys;
+    }
+
+    void write_json_(std::ostream& os, const sdsl::structure_tree_node* v, int depth) const {
+        os << "{\"name\": \"" << v->name << "\", \"type\": \"" << escape_(v->type) << "\", \"bytes\": " << v->size
+           << ", \"bits_per_key\": " << get_bits_per_key_(v->size);
+        auto children = get_children_(v);
+        if (!children.empty()) {
+            os << ", \"children\": [";
+            for (size_t i = 0; i < children.size(); ++i) {
+                os << (i == 0 ? "" : ", ");
+                write_json_(os, children[i], depth + 1);
+            }
+            os << "]";
+        }
+        os << "}";
+    }
+
+    void write_table_(std::ostream& os, const sdsl::structure_tree_node* v, int depth) const {
+        const std::string label = std::string(depth * 2, ' ') + v->name;
+        os << std::left << std::setw(48) << label << std::right << std::setw(14) << v->size << std::setw(9)
+           << std::fixed << std::setprecision(2) << (m_total_bytes == 0 ? 0.0 : v->size * 100.0 / m_total_bytes)
+           << std::setw(14) << std::setprecision(3) << get_bits_per_key_(v->size) << '\n';
+        os.unsetf(std::ios::fixed);
+        for (auto child : get_children_(v)) {
+            write_table_(os, child, depth + 1);
+        }
+    }
+
+    static std::string escape_(const std::string& str) {
+        std::string ret;
+        for (char c : str) {
+            if (c == '"' or c == '\\') {
+                ret += '\\';
+            }
+            ret += c;
+        }
+        return ret;
+    }
+};
+
+}  // namespace sketch_search
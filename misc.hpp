@@ -3,15 +3,23 @@
 #include <cxxabi.h>
 #include <stdint.h>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
 #include <regex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <sdsl/bit_vectors.hpp>
@@ -20,6 +28,7 @@ namespace sketch_search {
 
 static constexpr int MAX_BITS = 8;
 static constexpr int MAX_DIM = 64;
+static constexpr int MAX_WORDS = MAX_DIM * MAX_BITS / 64;  // for packed codes
 
 enum class node_reps : int { HYBRID = 1, DHT = 2, LIST = 3 };
 
@@ -35,19 +44,63 @@ inline std::string get_rep_name(node_reps rep) {
     return "????????";
 }
 
+// Tag of the index format at the head of config_t, which index files store as raw bytes. It changes
+// whenever the layout of config_t does, so that an index file of another layout is rejected on load.
+static constexpr uint32_t CONFIG_MAGIC = 0x02545362;  // "bST" + version 2
+
 struct config_t {
+    uint32_t magic = CONFIG_MAGIC;
     int dim;
     int bits;
     int blocks;
+    int matches;  // #blocks required to match in multi_index
+    int errs;  // radius the index is tuned for (used by hybrid_engine)
+    int threads;  // for construction
     float suf_thr;  // for super sparse layer
+    float load_factor;  // for hash_table (#keys / #slots)
+    bool pfx_filter;  // for hash_table
     node_reps rep_type;
 };
 
+// Loads the config of an index file, throwing std::runtime_error if the file is of another format
+inline void load_config(config_t& conf, std::istream& in) {
+    sdsl::load(conf, in);
+    if (!in or conf.magic != CONFIG_MAGIC) {
+        throw std::runtime_error("incompatible index format (rebuild the index)");
+    }
+}
+
 struct score_t {
     uint32_t id;
     int errs;
 };
 
+// Visitor of searchers that only counts the answers. The trie and hash table recognize it and add the
+// sizes of ID groups without reading the IDs.
+struct id_counter {
+    uint64_t num = 0;
+
+    bool operator()(uint32_t, int) {
+        ++num;
+        return true;
+    }
+};
+
+class timer {
+  public:
+    using hrc = std::chrono::high_resolution_clock;
+
+    timer() = default;
+
+    template <class Duration>
+    double get() const {
+        return std::chrono::duration_cast<Duration>(hrc::now() - tp_).count();
+    }
+
+  private:
+    hrc::time_point tp_ = hrc::now();
+};
+
 template <class It>
 inline void print_ints(std::ostream& os, It beg, It end, const char* title) {
     if (title) {
@@ -78,20 +131,223 @@ constexpr size_t array_size(const T (&array)[Num]) {
 struct stat_t {
     size_t num_cands = 0;
     size_t num_actnodes = 0;
+    size_t num_hashed = 0;  // #queries of hash_table solved by probing signatures
+    size_t num_scanned = 0;  // #queries of hash_table solved by linear scan
+
+    // Counted only with ENABLE_STATS (see COUNT_STAT)
+    size_t num_dense_nodes = 0;  // active nodes of sketch_trie for each layer
+    size_t num_dht_nodes = 0;
+    size_t num_list_nodes = 0;
+    size_t num_sparse_nodes = 0;
+    size_t num_ranks = 0;
+    size_t num_selects = 0;
+    size_t num_sufs_scanned = 0;
+    size_t num_sufs_matched = 0;
+    size_t num_ids = 0;  // emitted
 };
 
+// Fine-grained counters of the hot paths are compiled only with ENABLE_STATS
+#ifdef ENABLE_STATS
+#define COUNT_STAT(stat, field, num) ((stat).field += (num))
+#else
+#define COUNT_STAT(stat, field, num) ((void)0)
+#endif
+
 struct entry_t {
     const uint8_t* key;
     std::vector<uint32_t> ids;
 };
 
-inline std::vector<entry_t> make_entries(const std::vector<const uint8_t*>& keys, int dim) {
+// Runs func(i) for i in [0, num_tasks) on the given number of threads
+template <class Func>
+inline void parallel_for(size_t num_tasks, int threads, Func&& func) {
+    threads = int(std::min<size_t>(std::max(threads, 1), num_tasks));
+    if (threads <= 1) {
+        for (size_t i = 0; i < num_tasks; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next_task{0};
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            for (size_t i = next_task++; i < num_tasks; i = next_task++) {
+                func(i);
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Persistent threads running func(i) for i in [0, num_tasks) with the caller, as parallel_for does without
+// starting threads for every call (e.g., for every query)
+class thread_pool {
+  public:
+    explicit thread_pool(int threads) {
+        for (int t = 1; t < threads; ++t) {
+            m_workers.emplace_back([this]() { work_(); });
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cond.notify_all();
+        for (auto& w : m_workers) {
+            w.join();
+        }
+    }
+
+    int num_threads() const {
+        return int(m_workers.size()) + 1;
+    }
+
+    template <class Func>
+    void run(size_t num_tasks, Func&& func) {
+        const std::function<void(size_t)> task = std::ref(func);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = &task;
+            m_num_tasks = num_tasks;
+            m_next_task = 0;
+            m_num_running = m_workers.size();
+            ++m_epoch;
+        }
+        m_cond.notify_all();
+        run_tasks_();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&] { return m_num_running == 0; });
+        m_task = nullptr;
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+  private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_done;
+    const std::function<void(size_t)>* m_task = nullptr;
+    size_t m_num_tasks = 0;
+    std::atomic<size_t> m_next_task{0};
+    size_t m_num_running = 0;  // workers that have not finished the current run
+    uint64_t m_epoch = 0;  // of the current run
+    bool m_closed = false;
+
+    void run_tasks_() {
+        for (size_t i = m_next_task++; i < m_num_tasks; i = m_next_task++) {
+            (*m_task)(i);
+        }
+    }
+
+    void work_() {
+        for (uint64_t epoch = 0;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [&] { return m_closed or m_epoch != epoch; });
+                if (m_closed) {
+                    return;
+                }
+                epoch = m_epoch;
+            }
+            run_tasks_();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_num_running == 0) {
+                m_done.notify_one();
+            }
+        }
+    }
+};
+
+// Allocator aligning the memory to Align bytes, e.g., to the cache lines loaded by SIMD instructions
+template <class T, size_t Align>
+struct aligned_allocator {
+    using value_type = T;
+
+    template <class U>
+    struct rebind {
+        using other = aligned_allocator<U, Align>;
+    };
+
+    aligned_allocator() = default;
+    template <class U>
+    aligned_allocator(const aligned_allocator<U, Align>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(Align));
+    }
+
+    template <class U>
+    bool operator==(const aligned_allocator<U, Align>&) const {
+        return true;
+    }
+    template <class U>
+    bool operator!=(const aligned_allocator<U, Align>&) const {
+        return false;
+    }
+};
+
+// Sorts key IDs in the lexicographical order of the keys.
+// If the keys fit in 64 bits, they are packed into integers and radix-sorted.
+inline std::vector<uint32_t> sort_keys(const std::vector<const uint8_t*>& keys, int dim, int bits) {
     std::vector<uint32_t> perms(keys.size());
     std::iota(perms.begin(), perms.end(), 0);
-    std::sort(perms.begin(), perms.end(), [&](uint32_t i1, uint32_t i2) {
-        int cmp = std::memcmp(keys[i1], keys[i2], dim);
-        return cmp < 0;
-    });
+
+    if (dim * bits > 64) {
+        std::sort(perms.begin(), perms.end(), [&](uint32_t i1, uint32_t i2) {
+            int cmp = std::memcmp(keys[i1], keys[i2], dim);
+            return cmp < 0;
+        });
+        return perms;
+    }
+
+    // The first element is placed in the most significant bits
+    std::vector<uint64_t> codes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        uint64_t code = 0;
+        for (int j = 0; j < dim; ++j) {
+            code = (code << bits) | keys[i][j];
+        }
+        codes[i] = code;
+    }
+
+    // LSD radix sort in bytes
+    std::vector<uint32_t> tmp_perms(keys.size());
+    const int num_bytes = (dim * bits + 7) / 8;
+
+    for (int k = 0; k < num_bytes; ++k) {
+        const int shift = k * 8;
+        size_t counts[257] = {};
+        for (uint32_t id : perms) {
+            ++counts[((codes[id] >> shift) & 0xFF) + 1];
+        }
+        if (*std::max_element(counts, counts + 257) == keys.size()) {
+            continue;  // all the keys have the same byte
+        }
+        std::partial_sum(counts, counts + 257, counts);
+        for (uint32_t id : perms) {
+            tmp_perms[counts[(codes[id] >> shift) & 0xFF]++] = id;
+        }
+        perms.swap(tmp_perms);
+    }
+
+    return perms;
+}
+
+inline std::vector<entry_t> make_entries(const std::vector<const uint8_t*>& keys, int dim, int bits) {
+    const std::vector<uint32_t> perms = sort_keys(keys, dim, bits);
 
     std::vector<entry_t> entries;
     entries.reserve(keys.size());
@@ -187,6 +443,63 @@ inline void to_vertical_code(const uint8_t* code, int bits, int dim, uint64_t* v
     }
 }
 
+inline int get_num_words(int bits, int dim) {
+    return (bits * dim + 63) / 64;
+}
+
+// Packs b-bit integers into 64-bit words, where the i-th integer is placed at bit offset i * bits
+inline void to_packed_code(const uint8_t* code, int bits, int dim, uint64_t* pcode) {
+    std::fill(pcode, pcode + get_num_words(bits, dim), 0ULL);
+    for (int i = 0; i < dim; ++i) {
+        const int offset = i * bits;
+        const uint64_t c = code[i];
+        pcode[offset / 64] |= c << (offset % 64);
+        if (offset % 64 + bits > 64) {  // straddling two words
+            pcode[offset / 64 + 1] |= c >> (64 - offset % 64);
+        }
+    }
+}
+
+// Replaces the pos-th integer c_old of a packed code by c_new
+inline void update_packed_code(uint64_t* pcode, int bits, int pos, uint8_t c_old, uint8_t c_new) {
+    const int offset = pos * bits;
+    const uint64_t diff = c_old ^ c_new;
+    pcode[offset / 64] ^= diff << (offset % 64);
+    if (offset % 64 + bits > 64) {  // straddling two words
+        pcode[offset / 64 + 1] ^= diff >> (64 - offset % 64);
+    }
+}
+
+// Sets the lowest bit of every integer in a packed code
+inline void get_packed_heads(int bits, int dim, uint64_t* heads) {
+    std::fill(heads, heads + get_num_words(bits, dim), 0ULL);
+    for (int i = 0; i < dim; ++i) {
+        const int offset = i * bits;
+        heads[offset / 64] |= 1ULL << (offset % 64);
+    }
+}
+
+// Hamming distance between packed codes, where heads is given by get_packed_heads
+inline int get_hamdist_p(const uint64_t* lhs, const uint64_t* rhs, const uint64_t* heads, int bits, int words,
+                         int max_errs = std::numeric_limits<int>::max()) {
+    int errs = 0;
+    uint64_t diff = lhs[0] ^ rhs[0];
+    for (int w = 0; w < words; ++w) {
+        const uint64_t next_diff = w + 1 < words ? lhs[w + 1] ^ rhs[w + 1] : 0;
+        // Folds the bits of each integer into its lowest bit, including those straddling the next word
+        uint64_t folded = diff;
+        for (int j = 1; j < bits; ++j) {
+            folded |= (diff >> j) | (next_diff << (64 - j));
+        }
+        errs += int(sdsl::bits::cnt(folded & heads[w]));
+        if (errs > max_errs) {
+            return errs;
+        }
+        diff = next_diff;
+    }
+    return errs;
+}
+
 // in bvecs format
 inline std::vector<uint8_t> load_sketches(const std::string& fn, const config_t& conf) {
     std::ios::sync_with_stdio(false);
@@ -4,6 +4,7 @@
 #include <numeric>
 
 #include "misc.hpp"
+#include "scan_index.hpp"
 
 namespace sketch_search {
 
@@ -25,31 +26,37 @@ class multi_index {
             std::cerr << "error: blocks < 2" << std::endl;
             exit(1);
         }
+        if (m_conf.matches < 1 or m_conf.blocks < m_conf.matches) {
+            std::cerr << "error: matches < 1 or blocks < matches" << std::endl;
+            exit(1);
+        }
 
         m_dims.resize(m_conf.blocks);
         m_indexes.resize(m_conf.blocks);
 
-        std::vector<const uint8_t*> sub_keys(keys.size());
-        int dim_beg = 0;
+        // Per-block radii for the radius the index is tuned for
+        std::vector<int> sub_errs(m_conf.blocks);
+        get_sub_errs(m_conf.errs, m_conf.blocks, m_conf.matches, sub_errs.data());
 
-        config_t conf_b = m_conf;
+        std::vector<int> dim_begs(m_conf.blocks + 1, 0);
         for (int b = 0; b < m_conf.blocks; ++b) {
             m_dims[b] = (int(m_conf.dim) + b) / m_conf.blocks;
+            dim_begs[b + 1] = dim_begs[b] + m_dims[b];
+        }
 
+        auto build_block = [&](int b) {
+            std::vector<const uint8_t*> sub_keys(keys.size());
             for (size_t i = 0; i < keys.size(); ++i) {
-                sub_keys[i] = keys[i] + dim_beg;
+                sub_keys[i] = keys[i] + dim_begs[b];
             }
+            config_t conf_b = m_conf;
             conf_b.dim = m_dims[b];
+            conf_b.errs = sub_errs[b];
             m_indexes[b].build(sub_keys, conf_b);
-            dim_beg += m_dims[b];
-        }
+        };
 
-        uint64_t vcode[MAX_BITS];
-        m_vert_codes = sdsl::int_vector<>(keys.size() * uint64_t(conf.bits), 0, conf.dim);
-        for (size_t i = 0; i < keys.size(); ++i) {
-            to_vertical_code(keys[i], conf.bits, conf.dim, vcode);
-            std::copy(vcode, vcode + conf.bits, m_vert_codes.begin() + i * size_t(conf.bits));
-        }
+        parallel_for(m_conf.blocks, m_conf.threads, [&](size_t b) { build_block(int(b)); });
+        m_verifier.build(keys, m_conf);  // also in parallel
     }
 
     class searcher {
@@ -60,53 +67,59 @@ class multi_index {
 
         const std::vector<score_t>& operator()(const uint8_t* q, int max_errs, stat_t& stat) {
             m_score.clear();
-            reset_dupflags_();
+            (*this)(q, max_errs, stat, [&](uint32_t id, int errs) {
+                m_score.push_back({id, errs});
+                return true;
+            });
+            return m_score;
+        }
+
+        // Calls visit(id, errs) for each answer as soon as it is verified. The search stops once visit
+        // returns false, and then false is returned. Only the candidates are materialized.
+        template <class Visitor>
+        bool operator()(const uint8_t* q, int max_errs, stat_t& stat, Visitor&& visit) {
+            reset_counts_();
 
-            static uint64_t vq[MAX_BITS];
+            uint64_t vq[MAX_BITS];
             to_vertical_code(q, m_obj->m_conf.bits, m_obj->m_conf.dim, vq);
 
-            int blocks = m_obj->num_blocks();
-            {
-                float gph_errs = max_errs - blocks + 1;
-                for (int b = 0; b < blocks; ++b) {
-                    sub_errs_[b] = std::floor((gph_errs + b) / blocks);
-                }
-                assert(std::accumulate(sub_errs_.begin(), sub_errs_.end(), 0) == int(gph_errs));
-            }
+            const int blocks = m_obj->num_blocks();
+            const int matches = m_obj->m_conf.matches;
+
+            get_sub_errs(max_errs, blocks, matches, sub_errs_.data());
 
             for (int b = 0; b < blocks; ++b) {
                 const uint8_t* sub_q = q + dim_begs_[b];
 
-                // cand0, err0, cand1, err1, cand2, err2, ...
-                const std::vector<score_t>& cands = index_searchers_[b](sub_q, sub_errs_[b], stat);
-
-                for (size_t i = 0; i < cands.size(); ++i) {
-                    uint32_t cand = cands[i].id;
-
-                    if (get_dupflag_(cand)) {
-                        continue;
+                index_searchers_[b](sub_q, sub_errs_[b], stat, [&](uint32_t cand, int) {
+                    if (counts_[cand] == 0) {
+                        touched_.push_back(cand);
                     }
-
-                    ++stat.num_cands;
-
-                    uint64_t offset = cand * uint64_t(m_obj->m_conf.bits);
-                    const auto vcode = m_obj->m_vert_codes.begin() + offset;
-                    int hamdist = get_hamdist_v(vq, vcode, m_obj->m_conf.bits, max_errs);
-
-                    if (hamdist <= max_errs) {
-                        m_score.push_back({cand, hamdist});
+                    // Verify only once, when the candidate reaches the required #matches
+                    if (++counts_[cand] == matches) {
+                        verify_ids_.push_back(cand);
                     }
-                    set_dupflag_(cand);
-                }
+                    return true;
+                });
             }
 
-            return m_score;
+            stat.num_cands += verify_ids_.size();
+            return m_obj->m_verifier.verify(verify_ids_.data(), verify_ids_.size(), vq, max_errs, visit);
+        }
+
+        // Returns the number of answers. The candidates still have to be verified one by one.
+        uint64_t count(const uint8_t* q, int max_errs, stat_t& stat) {
+            id_counter counter;
+            (*this)(q, max_errs, stat, counter);
+            return counter.num;
         }
 
       private:
         const this_type* m_obj = nullptr;
         std::vector<score_t> m_score;
-        std::vector<uint64_t> dupflags_;
+        std::vector<uint8_t> counts_;  // #matched blocks for each key
+        std::vector<uint32_t> touched_;
+        std::vector<uint32_t> verify_ids_;
         std::vector<int> sub_errs_;
         std::vector<int> dim_begs_;
         std::vector<index_searcher_type> index_searchers_;
@@ -115,7 +128,9 @@ class multi_index {
             int blocks = m_obj->num_blocks();
 
             m_score.reserve(1U << 10);
-            dupflags_.resize(m_obj->num_keys() / 64 + 1);
+            counts_.resize(m_obj->num_keys());
+            touched_.reserve(1U << 10);
+            verify_ids_.reserve(1U << 10);
             sub_errs_.resize(blocks);
             dim_begs_.resize(blocks + 1);
 
@@ -128,18 +143,12 @@ class multi_index {
             dim_begs_[blocks] = dim_beg;
         }
 
-        bool get_dupflag_(uint64_t i) const {
-            assert(i / 64 < dupflags_.size());
-            return (dupflags_[i / 64] & (1ULL << (i % 64))) != 0;
-        }
-        void set_dupflag_(uint64_t i) {
-            assert(i / 64 < dupflags_.size());
-            dupflags_[i / 64] |= (1ULL << (i % 64));
-        }
-        void reset_dupflags_() {
-            for (uint64_t i = 0; i < dupflags_.size(); i++) {
-                dupflags_[i] = 0;
+        void reset_counts_() {
+            for (uint32_t id : touched_) {
+                counts_[id] = 0;
             }
+            touched_.clear();
+            verify_ids_.clear();
         }
 
         friend class multi_index;
@@ -149,6 +158,26 @@ class multi_index {
         return searcher(this);
     }
 
+    // A key within max_errs can mismatch at most (blocks - matches) blocks only if the smallest
+    // (blocks - matches + 1) values of (sub_errs[b] + 1) sum to more than max_errs.
+    // The thresholds are balanced and the minimum total is taken, as in GPH/HmSearch.
+    // For matches = 1, this is the plain pigeonhole partitioning (sum = max_errs - blocks + 1).
+    static void get_sub_errs(int max_errs, int blocks, int matches, int* sub_errs) {
+        const int k = blocks - matches + 1;
+
+        for (int s = 0;; ++s) {
+            const int base = s / blocks - 1;  // (blocks - rem) blocks get base, the others get base + 1
+            const int rem = s % blocks;
+            const int min_sum = k * (base + 1) + std::max(0, k - (blocks - rem));
+            if (min_sum > max_errs) {
+                for (int b = 0; b < blocks; ++b) {
+                    sub_errs[b] = b < blocks - rem ? base : base + 1;
+                }
+                return;
+            }
+        }
+    }
+
     void debug_dump(std::ostream& os) const {}
 
     uint64_t num_keys() const {
@@ -157,6 +186,9 @@ class multi_index {
     int num_blocks() const {
         return m_conf.blocks;
     }
+    const Index& get_index(int b) const {
+        return m_indexes[b];
+    }
     config_t get_config() const {
         return m_conf;
     }
@@ -167,22 +199,37 @@ class multi_index {
         }
     }
 
+    void write_shape_csv(std::ostream& os, int) const {
+        for (int b = 0; b < m_conf.blocks; ++b) {
+            m_indexes[b].write_shape_csv(os, b);
+        }
+    }
+
     size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
         auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
         size_type written_bytes = 0;
         written_bytes += sdsl::serialize(m_conf, out, child, "m_conf");
         written_bytes += sdsl::serialize(m_dims, out, child, "m_dims");
-        written_bytes += sdsl::serialize(m_indexes, out, child, "m_indexes");
-        written_bytes += sdsl::serialize(m_vert_codes, out, child, "m_vert_codes");
+        {
+            // Same bytes as sdsl::serialize(m_indexes), but each block is named in the structure tree
+            auto indexes = sdsl::structure_tree::add_child(child, "m_indexes", sdsl::util::class_name(m_indexes));
+            size_type indexes_bytes = sdsl::write_member(m_indexes.size(), out, indexes, "size");
+            for (size_t b = 0; b < m_indexes.size(); ++b) {
+                indexes_bytes += m_indexes[b].serialize(out, indexes, "m_indexes[" + std::to_string(b) + "]");
+            }
+            sdsl::structure_tree::add_size(indexes, indexes_bytes);
+            written_bytes += indexes_bytes;
+        }
+        written_bytes += sdsl::serialize(m_verifier, out, child, "m_verifier");
         sdsl::structure_tree::add_size(child, written_bytes);
         return written_bytes;
     }
 
     void load(std::istream& in) {
-        sdsl::load(m_conf, in);
+        load_config(m_conf, in);
         sdsl::load(m_dims, in);
         sdsl::load(m_indexes, in);
-        sdsl::load(m_vert_codes, in);
+        sdsl::load(m_verifier, in);
     }
 
     multi_index(const multi_index&) = delete;
@@ -196,7 +243,7 @@ class multi_index {
             m_conf = std::move(rhs.m_conf);
             m_dims = std::move(rhs.m_dims);
             m_indexes = std::move(rhs.m_indexes);
-            m_vert_codes = std::move(rhs.m_vert_codes);
+            m_verifier = std::move(rhs.m_verifier);
         }
         return *this;
     }
@@ -205,7 +252,7 @@ class multi_index {
     config_t m_conf;
     std::vector<int> m_dims;
     std::vector<index_type> m_indexes;
-    sdsl::int_vector<> m_vert_codes;
+    scan_index m_verifier;
 };
 
 }  // namespace sketch_search
\ No newline at end of file
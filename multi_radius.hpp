@@ -0,0 +1,77 @@
+#pragma once
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Searcher answering a query for all the radii up to max_errs at once. Since every index reports the
+// exact errs of each answer, one search within max_errs (e.g., one trie traversal, or one enumeration of
+// hash signatures from 0 errs up to max_errs) is bucketed by errs with a counting sort. The answers are
+// ordered by errs, so those within a smaller radius are a prefix of them.
+template <class Index>
+class multi_radius_searcher {
+  public:
+    using index_searcher_type = typename Index::searcher;
+
+    explicit multi_radius_searcher(const Index& index) : m_searcher(index.make_searcher()) {
+        m_scores.reserve(1U << 10);
+        m_sorted.reserve(1U << 10);
+    }
+
+    // Searches for q within max_errs and buckets the answers by errs
+    void operator()(const uint8_t* q, int max_errs, stat_t& stat) {
+        m_max_errs = max_errs;
+        m_scores.clear();
+        m_begs.assign(std::max(max_errs, -1) + 2, 0);
+
+        m_searcher(q, max_errs, stat, [&](uint32_t id, int errs) {
+            m_scores.push_back({id, errs});
+            ++m_begs[errs + 1];
+            return true;
+        });
+
+        for (int e = 0; e <= max_errs; ++e) {
+            m_begs[e + 1] += m_begs[e];
+        }
+        m_sorted.resize(m_scores.size());
+        m_pos.assign(m_begs.begin(), m_begs.end() - 1);
+        for (const score_t& score : m_scores) {
+            m_sorted[m_pos[score.errs]++] = score;
+        }
+    }
+
+    int get_max_errs() const {
+        return m_max_errs;
+    }
+
+    // #answers within errs (<= max_errs of the last search)
+    uint64_t num_within(int errs) const {
+        return errs < 0 ? 0 : m_begs[std::min(errs, m_max_errs) + 1];
+    }
+    // #answers of exactly errs
+    uint64_t num_exact(int errs) const {
+        return errs < 0 or m_max_errs < errs ? 0 : m_begs[errs + 1] - m_begs[errs];
+    }
+
+    // Answers in the order of errs, whose first num_within(errs) ones are within errs
+    const score_t* data() const {
+        return m_sorted.data();
+    }
+    // Answers of exactly errs
+    const score_t* begin_exact(int errs) const {
+        return m_sorted.data() + m_begs[errs];
+    }
+    const score_t* end_exact(int errs) const {
+        return m_sorted.data() + m_begs[errs + 1];
+    }
+
+  private:
+    index_searcher_type m_searcher;
+    int m_max_errs = -1;
+    std::vector<score_t> m_scores;  // in the order found
+    std::vector<score_t> m_sorted;  // in the order of errs
+    std::vector<uint64_t> m_begs;  // of the answers of each errs in m_sorted
+    std::vector<uint64_t> m_pos;
+};
+
+}  // namespace sketch_search
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Hardware performance counters of the calling thread and the threads it creates after the construction
+// (e.g., those of parallel_for), via Linux perf_event_open. The counts of a created thread are included
+// once it is joined.
+// Each event is opened independently, so unsupported or forbidden events (e.g., in containers or with
+// a high perf_event_paranoid) are just reported as unavailable and the others still work.
+// Values are scaled if the kernel multiplexes the events. An event that could not be read or never ran
+// between start() and stop() has no value for the run.
+class perf_counters {
+  public:
+    enum events : int { CYCLES, INSTRUCTIONS, BRANCHES, BRANCH_MISSES, LLC_MISSES, DTLB_MISSES, NUM_EVENTS };
+
+    perf_counters() {
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            m_fds[e] = open_(e);
+        }
+    }
+    ~perf_counters() {
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    bool is_available(int e) const {
+        return m_fds[e] >= 0;
+    }
+    bool is_any_available() const {
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            if (is_available(e)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start() {
+        std::fill(m_measured, m_measured + NUM_EVENTS, false);
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            if (m_fds[e] < 0) {
+                continue;
+            }
+            ioctl(m_fds[e], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t buf[3];  // value, time enabled, time running
+            if (read(m_fds[e], buf, sizeof(buf)) != sizeof(buf) or buf[2] == 0) {
+                m_values[e] = 0.0;
+                continue;
+            }
+            m_values[e] = double(buf[0]) * double(buf[1]) / double(buf[2]);
+            m_measured[e] = true;
+        }
+#endif
+    }
+
+    // Whether the event was counted between the last start() and stop()
+    bool has_value(int e) const {
+        return m_measured[e];
+    }
+    // The value counted between the last start() and stop()
+    double get(int e) const {
+        return m_values[e];
+    }
+
+    static const char* get_name(int e) {
+        static const char* names[] = {"cycles", "instructions", "branches", "branch_misses", "llc_misses", "dtlb_misses"};
+        return names[e];
+    }
+
+  private:
+    int m_fds[NUM_EVENTS];
+    double m_values[NUM_EVENTS] = {};
+    bool m_measured[NUM_EVENTS] = {};
+
+    static int open_(int e) {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;  // counts the worker threads of the construction and scan as well
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        const uint64_t cache_read_miss =
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        switch (e) {
+            case CYCLES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case INSTRUCTIONS:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case BRANCHES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+                break;
+            case BRANCH_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            case LLC_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL | cache_read_miss;
+                break;
+            case DTLB_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB | cache_read_miss;
+                break;
+            default:
+                return -1;
+        }
+        return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+        return -1;
+#endif
+    }
+};
+
+}  // namespace sketch_search
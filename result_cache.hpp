@@ -0,0 +1,307 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Concurrent cache of answers keyed by the bytes of a query sketch, bounded by a memory budget.
+// An entry keeps the answers for the largest radius searched so far, so a query within a smaller radius
+// is answered by filtering them on errs. The cache is split into shards locked independently, and each
+// shard evicts its entries in CLOCK order (i.e., second chance) to stay within its share of the budget.
+class result_cache {
+  public:
+    static constexpr int SHARD_BITS = 4;
+    static constexpr int NUM_SHARDS = 1 << SHARD_BITS;
+
+    // Bytes of an entry besides its sketch and answers, including the node of the hash map
+    static constexpr uint64_t ENTRY_OVERHEAD = 96;
+
+    explicit result_cache(uint64_t capacity_bytes) : m_shard_capacity(capacity_bytes / NUM_SHARDS) {}
+
+    // Replaces scores with the answers of the sketch q within max_errs if cached
+    bool find(const uint8_t* q, int dim, int max_errs, std::vector<score_t>& scores) {
+        const uint64_t hash = get_hash_(q, dim);
+        shard_t& shard = get_shard_(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        const auto it = shard.map.find(hash);
+        if (it == shard.map.end() or !matches_(shard.entries[it->second], q, dim, max_errs)) {
+            ++shard.num_misses;
+            return false;
+        }
+        entry_t& entry = shard.entries[it->second];
+        entry.referenced = true;
+        ++shard.num_hits;
+
+        scores.clear();
+        if (entry.max_errs == max_errs) {
+            scores.assign(entry.scores.begin(), entry.scores.end());
+        } else {
+            for (const score_t& score : entry.scores) {
+                if (score.errs <= max_errs) {
+                    scores.push_back(score);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Caches the answers of the sketch q within max_errs, unless those within a larger radius are cached
+    void insert(const uint8_t* q, int dim, int max_errs, const std::vector<score_t>& scores) {
+        const uint64_t bytes = get_entry_bytes_(dim, scores.size());
+        if (m_shard_capacity < bytes) {
+            return;
+        }
+
+        const uint64_t hash = get_hash_(q, dim);
+        shard_t& shard = get_shard_(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.map.find(hash);
+        if (it != shard.map.end()) {
+            const entry_t& entry = shard.entries[it->second];
+            if (matches_(entry, q, dim, max_errs)) {
+                return;
+            }
+            evict_(shard, it->second);  // for a smaller radius or a colliding sketch
+        }
+        while (m_shard_capacity < shard.bytes + bytes) {
+            advance_hand_(shard);
+        }
+
+        uint32_t slot;
+        if (shard.free_slots.empty()) {
+            slot = uint32_t(shard.entries.size());
+            shard.entries.emplace_back();
+        } else {
+            slot = shard.free_slots.back();
+            shard.free_slots.pop_back();
+        }
+        entry_t& entry = shard.entries[slot];
+        entry.used = true;
+        entry.referenced = false;
+        entry.max_errs = max_errs;
+        entry.key.assign(q, q + dim);
+        entry.scores.assign(scores.begin(), scores.end());
+        entry.bytes = bytes;
+
+        shard.map.emplace(hash, slot);
+        shard.bytes += bytes;
+    }
+
+    uint64_t num_hits() const {
+        return sum_(&shard_t::num_hits);
+    }
+    uint64_t num_misses() const {
+        return sum_(&shard_t::num_misses);
+    }
+    double get_hit_rate() const {
+        const uint64_t hits = num_hits();
+        const uint64_t lookups = hits + num_misses();
+        return lookups == 0 ? 0.0 : double(hits) / lookups;
+    }
+    uint64_t num_entries() const {
+        uint64_t num = 0;
+        for (const shard_t& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            num += shard.map.size();
+        }
+        return num;
+    }
+    uint64_t get_bytes() const {
+        return sum_(&shard_t::bytes);
+    }
+    uint64_t get_capacity() const {
+        return m_shard_capacity * NUM_SHARDS;
+    }
+
+    void reset_stats() {
+        for (shard_t& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.num_hits = 0;
+            shard.num_misses = 0;
+        }
+    }
+
+    void show_stats(std::ostream& os) const {
+        os << "Statistics of result_cache\n";
+        os << "--> hit_rate: " << get_hit_rate() << '\n';
+        os << "--> num_hits: " << num_hits() << '\n';
+        os << "--> num_misses: " << num_misses() << '\n';
+        os << "--> num_entries: " << num_entries() << '\n';
+        os << "--> bytes: " << get_bytes() << '\n';
+        os << "--> capacity: " << get_capacity() << std::endl;
+    }
+
+    result_cache(const result_cache&) = delete;
+    result_cache& operator=(const result_cache&) = delete;
+
+  private:
+    struct entry_t {
+        bool used = false;
+        bool referenced = false;  // since the hand passed
+        int max_errs = -1;
+        uint64_t bytes = 0;
+        std::vector<uint8_t> key;
+        std::vector<score_t> scores;  // within max_errs
+    };
+
+    struct alignas(64) shard_t {
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, uint32_t> map;  // hash of sketch to entry
+        std::vector<entry_t> entries;
+        std::vector<uint32_t> free_slots;
+        size_t hand = 0;
+        uint64_t bytes = 0;
+        uint64_t num_hits = 0;
+        uint64_t num_misses = 0;
+    };
+
+    uint64_t m_shard_capacity;
+    std::array<shard_t, NUM_SHARDS> m_shards;
+
+    static uint64_t get_entry_bytes_(int dim, size_t num_scores) {
+        return ENTRY_OVERHEAD + sizeof(entry_t) + dim + num_scores * sizeof(score_t);
+    }
+
+    // FNV-1a followed by the finalizer of splitmix64, whose top bits choose the shard
+    static uint64_t get_hash_(const uint8_t* q, int dim) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (int i = 0; i < dim; ++i) {
+            hash ^= q[i];
+            hash *= 0x100000001b3;
+        }
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+        return hash ^ (hash >> 31);
+    }
+
+    shard_t& get_shard_(uint64_t hash) {
+        return m_shards[hash >> (64 - SHARD_BITS)];
+    }
+
+    static bool matches_(const entry_t& entry, const uint8_t* q, int dim, int max_errs) {
+        return max_errs <= entry.max_errs and entry.key.size() == size_t(dim) and
+               std::equal(entry.key.begin(), entry.key.end(), q);
+    }
+
+    static void evict_(shard_t& shard, uint32_t slot) {
+        entry_t& entry = shard.entries[slot];
+        shard.map.erase(get_hash_(entry.key.data(), int(entry.key.size())));
+        shard.bytes -= entry.bytes;
+        entry.used = false;
+        std::vector<uint8_t>().swap(entry.key);
+        std::vector<score_t>().swap(entry.scores);
+        shard.free_slots.push_back(slot);
+    }
+
+    // Evicts the entry under the hand unless it was referenced, in which case it gets a second chance
+    static void advance_hand_(shard_t& shard) {
+        entry_t& entry = shard.entries[shard.hand];
+        if (entry.used) {
+            if (entry.referenced) {
+                entry.referenced = false;
+            } else {
+                evict_(shard, uint32_t(shard.hand));
+            }
+        }
+        if (++shard.hand == shard.entries.size()) {
+            shard.hand = 0;
+        }
+    }
+
+    template <class T>
+    T sum_(T shard_t::*member) const {
+        T sum = 0;
+        for (const shard_t& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            sum += shard.*member;
+        }
+        return sum;
+    }
+};
+
+// Index adapter whose searchers look up the result cache before searching the index. Each thread has
+// its own searcher, while the cache is shared.
+template <class Index>
+class cached_index {
+  public:
+    cached_index(const Index& index, result_cache& cache) : m_index(&index), m_cache(&cache) {}
+
+    class searcher {
+      public:
+        searcher() = default;
+
+        const std::vector<score_t>& operator()(const uint8_t* q, int max_errs, stat_t& stat) {
+            if (m_obj->m_cache->find(q, m_dim, max_errs, m_score)) {
+                return m_score;
+            }
+            const std::vector<score_t>& ret = m_searcher(q, max_errs, stat);
+            m_obj->m_cache->insert(q, m_dim, max_errs, ret);
+            return ret;
+        }
+
+        // Calls visit(id, errs) for each answer, from the cache on a hit. On a miss, the answers are visited
+        // as soon as they are found and cached unless visit stops the search.
+        template <class Visitor>
+        bool operator()(const uint8_t* q, int max_errs, stat_t& stat, Visitor&& visit) {
+            if (m_obj->m_cache->find(q, m_dim, max_errs, m_score)) {
+                for (const score_t& score : m_score) {
+                    if (!visit(score.id, score.errs)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            m_score.clear();
+            const bool completed = m_searcher(q, max_errs, stat, [&](uint32_t id, int errs) {
+                m_score.push_back({id, errs});
+                return visit(id, errs);
+            });
+            if (completed) {
+                m_obj->m_cache->insert(q, m_dim, max_errs, m_score);
+            }
+            return completed;
+        }
+
+        // Returns the number of answers. A miss reports the answers to cache them instead of counting them
+        // by the index.
+        uint64_t count(const uint8_t* q, int max_errs, stat_t& stat) {
+            return (*this)(q, max_errs, stat).size();
+        }
+
+      private:
+        const cached_index* m_obj = nullptr;
+        int m_dim = 0;
+        typename Index::searcher m_searcher;
+        std::vector<score_t> m_score;  // of a hit or a visited miss
+
+        explicit searcher(const cached_index* obj)
+            : m_obj(obj), m_dim(int(obj->m_index->get_config().dim)), m_searcher(obj->m_index->make_searcher()) {
+            m_score.reserve(1U << 10);
+        }
+
+        friend class cached_index;
+    };  // searcher
+
+    searcher make_searcher() const {
+        return searcher(this);
+    }
+
+    uint64_t num_keys() const {
+        return m_index->num_keys();
+    }
+    config_t get_config() const {
+        return m_index->get_config();
+    }
+
+  private:
+    const Index* m_index;
+    result_cache* m_cache;
+};
+
+}  // namespace sketch_search
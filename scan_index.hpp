@@ -0,0 +1,331 @@
+#pragma once
+
+#if defined(__AVX512F__) or defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Brute-force index that stores the keys as bit-planes (i.e., vertical codes) in groups of LANES keys.
+// The j-th planes of a group are contiguous, so the distances of a group are computed by ORing the
+// XORs of the planes and counting the bits of each lane with a few SIMD instructions. The planes are
+// aligned to cache lines, so each SIMD load touches one line.
+class scan_index {
+  public:
+    using size_type = uint64_t;  // for sdsl
+
+    static constexpr size_t LANES = 8;  // one 512-bit register of planes
+    static constexpr size_t MIN_KEYS_PER_THREAD = 1U << 18;
+    static constexpr size_t VERIFY_PREFETCH_DIST = 8;
+
+    scan_index() = default;
+    ~scan_index() = default;
+
+    void build(const std::vector<const uint8_t*>& keys, const config_t& conf) {
+        m_conf = conf;
+        m_num_keys = keys.size();
+
+        const int bits = m_conf.bits;
+        const size_t num_groups = (keys.size() + LANES - 1) / LANES;
+        m_planes.resize(num_groups * bits * LANES);  // padded with zeros
+
+        parallel_for(num_groups, m_conf.threads, [&](size_t g) {
+            uint64_t vcode[MAX_BITS];
+            uint64_t* group = m_planes.data() + g * bits * LANES;
+            for (size_t l = 0; l < LANES and g * LANES + l < keys.size(); ++l) {
+                to_vertical_code(keys[g * LANES + l], bits, m_conf.dim, vcode);
+                for (int j = 0; j < bits; ++j) {
+                    group[j * LANES + l] = vcode[j];
+                }
+            }
+        });
+    }
+
+    class searcher {
+      public:
+        searcher() = default;
+
+        const std::vector<score_t>& operator()(const uint8_t* q, int max_errs, stat_t& stat) {
+            m_score.clear();
+            if (max_errs < 0) {
+                return m_score;
+            }
+
+            uint64_t vq[MAX_BITS];
+            to_vertical_code(q, m_obj->m_conf.bits, m_obj->m_conf.dim, vq);
+
+            const size_t num_groups = m_obj->num_groups_();
+            const size_t threads = get_query_threads_();
+            if (threads <= 1) {
+                m_obj->scan_(vq, max_errs, 0, num_groups, [&](uint32_t id, int errs) {
+                    m_score.push_back({id, errs});
+                    return true;
+                });
+                return m_score;
+            }
+
+            // Each thread of the pool scans a range of IDs, and the results are concatenated in the order of IDs
+            if (!m_pool or m_pool->num_threads() != int(threads)) {
+                m_pool = std::make_unique<thread_pool>(int(threads));
+            }
+            m_thread_scores.resize(threads);
+            m_pool->run(threads, [&](size_t t) {
+                auto& scores = m_thread_scores[t];
+                scores.clear();
+                m_obj->scan_(vq, max_errs, num_groups * t / threads, num_groups * (t + 1) / threads,
+                             [&](uint32_t id, int errs) {
+                                 scores.push_back({id, errs});
+                                 return true;
+                             });
+            });
+            for (const auto& scores : m_thread_scores) {
+                m_score.insert(m_score.end(), scores.begin(), scores.end());
+            }
+            return m_score;
+        }
+
+        // Calls visit(id, errs) for each answer in the order of IDs, stopping once visit returns false,
+        // and then false is returned. With multiple threads, the answers are visited after the scan.
+        template <class Visitor>
+        bool operator()(const uint8_t* q, int max_errs, stat_t& stat, Visitor&& visit) {
+            if (max_errs < 0) {
+                return true;
+            }
+            if (get_query_threads_() <= 1) {
+                uint64_t vq[MAX_BITS];
+                to_vertical_code(q, m_obj->m_conf.bits, m_obj->m_conf.dim, vq);
+                return m_obj->scan_(vq, max_errs, 0, m_obj->num_groups_(), visit);
+            }
+            for (const score_t& score : (*this)(q, max_errs, stat)) {
+                if (!visit(score.id, score.errs)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        uint64_t count(const uint8_t* q, int max_errs, stat_t& stat) {
+            id_counter counter;
+            (*this)(q, max_errs, stat, counter);
+            return counter.num;
+        }
+
+        // #threads used per query (1 by default), which are started at the first query and kept by the searcher
+        void set_threads(int threads) {
+            m_threads = threads;
+        }
+
+      private:
+        const scan_index* m_obj = nullptr;
+        int m_threads = 1;
+        std::vector<score_t> m_score;
+        std::vector<std::vector<score_t>> m_thread_scores;
+        std::unique_ptr<thread_pool> m_pool;
+
+        searcher(const scan_index* obj) : m_obj(obj) {
+            m_score.reserve(1U << 10);
+        }
+
+        size_t get_query_threads_() const {
+            return std::min<size_t>(std::max(m_threads, 1), m_obj->m_num_keys / MIN_KEYS_PER_THREAD);
+        }
+
+        friend class scan_index;
+    };  // searcher
+
+    searcher make_searcher() const {
+        return searcher(this);
+    }
+
+    // Appends the given IDs within max_errs from the vertical code vq, as the verifier of multi_index.
+    void verify(const uint32_t* ids, size_t num_ids, const uint64_t* vq, int max_errs,
+                std::vector<score_t>& scores) const {
+        verify(ids, num_ids, vq, max_errs, [&](uint32_t id, int errs) {
+            scores.push_back({id, errs});
+            return true;
+        });
+    }
+
+    // Calls visit(id, errs) for the given IDs within max_errs, stopping once visit returns false.
+    // The planes of upcoming IDs are prefetched since the IDs are random.
+    template <class Visitor>
+    bool verify(const uint32_t* ids, size_t num_ids, const uint64_t* vq, int max_errs, Visitor&& visit) const {
+        const int bits = m_conf.bits;
+        for (size_t i = 0; i < num_ids; ++i) {
+            if (i + VERIFY_PREFETCH_DIST < num_ids) {
+                const uint64_t* planes = get_planes_(ids[i + VERIFY_PREFETCH_DIST]);
+                for (int j = 0; j < bits; ++j) {
+                    __builtin_prefetch(planes + j * LANES);
+                }
+            }
+            const uint64_t* planes = get_planes_(ids[i]);
+            uint64_t cumdiff = 0;
+            for (int j = 0; j < bits; ++j) {
+                cumdiff |= planes[j * LANES] ^ vq[j];
+            }
+            const int errs = int(sdsl::bits::cnt(cumdiff));
+            if (errs <= max_errs and !visit(ids[i], errs)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t num_keys() const {
+        return m_num_keys;
+    }
+    config_t get_config() const {
+        return m_conf;
+    }
+
+    void show_stats(std::ostream& os) const {
+        os << "Statistics of scan_index\n";
+        os << "--> simd: " << get_simd_name() << '\n';
+        os << "--> lanes: " << LANES << std::endl;
+    }
+
+    void write_shape_csv(std::ostream&, int) const {}  // no trie
+
+    static const char* get_simd_name() {
+#if defined(__AVX512F__) and defined(__AVX512VPOPCNTDQ__)
+        return "AVX-512 VPOPCNTDQ";
+#elif defined(__AVX2__)
+        return "AVX2";
+#else
+        return "none";
+#endif
+    }
+
+    size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
+        auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
+        size_type written_bytes = 0;
+        written_bytes += sdsl::serialize(m_conf, out, child, "m_conf");
+        written_bytes += sdsl::serialize(m_num_keys, out, child, "m_num_keys");
+        {
+            // Same bytes as sdsl::serialize of std::vector, which does not take the aligned allocator
+            auto planes = sdsl::structure_tree::add_child(child, "m_planes", "std::vector");
+            size_type planes_bytes = sdsl::write_member(uint64_t(m_planes.size()), out, planes, "size");
+            out.write(reinterpret_cast<const char*>(m_planes.data()), m_planes.size() * sizeof(uint64_t));
+            planes_bytes += m_planes.size() * sizeof(uint64_t);
+            sdsl::structure_tree::add_size(planes, planes_bytes);
+            written_bytes += planes_bytes;
+        }
+        sdsl::structure_tree::add_size(child, written_bytes);
+        return written_bytes;
+    }
+
+    void load(std::istream& in) {
+        load_config(m_conf, in);
+        sdsl::load(m_num_keys, in);
+        uint64_t num_planes = 0;
+        sdsl::load(num_planes, in);
+        m_planes.resize(num_planes);
+        in.read(reinterpret_cast<char*>(m_planes.data()), num_planes * sizeof(uint64_t));
+    }
+
+    scan_index(const scan_index&) = delete;
+    scan_index& operator=(const scan_index&) = delete;
+
+    scan_index(scan_index&& rhs) noexcept : scan_index() {
+        *this = std::move(rhs);
+    }
+    scan_index& operator=(scan_index&& rhs) noexcept {
+        if (this != &rhs) {
+            m_conf = std::move(rhs.m_conf);
+            m_num_keys = std::move(rhs.m_num_keys);
+            m_planes = std::move(rhs.m_planes);
+        }
+        return *this;
+    }
+
+  private:
+    config_t m_conf;
+    uint64_t m_num_keys = 0;
+    std::vector<uint64_t, aligned_allocator<uint64_t, 64>> m_planes;  // [group][plane][lane]
+
+    size_t num_groups_() const {
+        return (m_num_keys + LANES - 1) / LANES;
+    }
+
+    // The first plane of the key, whose j-th plane is at offset j * LANES
+    const uint64_t* get_planes_(uint32_t id) const {
+        return m_planes.data() + (id / LANES) * m_conf.bits * LANES + id % LANES;
+    }
+
+    // Returns false if visit stopped the scan
+    template <class Visitor>
+    bool scan_(const uint64_t* vq, int max_errs, size_t group_beg, size_t group_end, Visitor&& visit) const {
+        const int bits = m_conf.bits;
+        uint64_t errs[LANES];
+
+        for (size_t g = group_beg; g < group_end; ++g) {
+            uint32_t mask = match_group_(m_planes.data() + g * bits * LANES, vq, bits, max_errs, errs);
+            if (mask == 0) {
+                continue;
+            }
+            if (g == num_groups_() - 1) {  // excludes the padding
+                mask &= (1U << (m_num_keys - g * LANES)) - 1;
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                const uint32_t l = __builtin_ctz(mask);
+                if (!visit(uint32_t(g * LANES + l), int(errs[l]))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Computes the distances of the keys in a group and returns the mask of lanes within max_errs
+    static uint32_t match_group_(const uint64_t* group, const uint64_t* vq, int bits, int max_errs,
+                                 uint64_t* errs) {
+#if defined(__AVX512F__) and defined(__AVX512VPOPCNTDQ__)
+        __m512i cumdiff = _mm512_setzero_si512();
+        for (int j = 0; j < bits; ++j) {
+            const __m512i planes = _mm512_load_si512(group + j * LANES);
+            cumdiff = _mm512_or_si512(cumdiff, _mm512_xor_si512(planes, _mm512_set1_epi64(int64_t(vq[j]))));
+        }
+        const __m512i cnts = _mm512_popcnt_epi64(cumdiff);
+        _mm512_storeu_si512(errs, cnts);
+        return _mm512_cmple_epu64_mask(cnts, _mm512_set1_epi64(max_errs));
+#elif defined(__AVX2__)
+        // Nibble-wise popcount by table lookup, summed up for each 64-bit lane
+        const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,  //
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0F);
+        const __m256i thr = _mm256_set1_epi64x(max_errs);
+
+        uint32_t mask = 0;
+        for (size_t h = 0; h < LANES; h += 4) {
+            __m256i cumdiff = _mm256_setzero_si256();
+            for (int j = 0; j < bits; ++j) {
+                const __m256i planes = _mm256_load_si256(reinterpret_cast<const __m256i*>(group + j * LANES + h));
+                cumdiff = _mm256_or_si256(cumdiff, _mm256_xor_si256(planes, _mm256_set1_epi64x(int64_t(vq[j]))));
+            }
+            const __m256i lo = _mm256_and_si256(cumdiff, low_mask);
+            const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(cumdiff, 4), low_mask);
+            const __m256i cnts8 = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+            const __m256i cnts = _mm256_sad_epu8(cnts8, _mm256_setzero_si256());
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(errs + h), cnts);
+            const __m256i over = _mm256_cmpgt_epi64(cnts, thr);
+            mask |= uint32_t(~_mm256_movemask_pd(_mm256_castsi256_pd(over)) & 0xF) << h;
+        }
+        return mask;
+#else
+        uint32_t mask = 0;
+        for (size_t l = 0; l < LANES; ++l) {
+            uint64_t cumdiff = 0;
+            for (int j = 0; j < bits; ++j) {
+                cumdiff |= group[j * LANES + l] ^ vq[j];
+            }
+            errs[l] = sdsl::bits::cnt(cumdiff);
+            mask |= uint32_t(errs[l] <= uint64_t(max_errs)) << l;
+        }
+        return mask;
+#endif
+    }
+};
+
+}  // namespace sketch_search
@@ -1,66 +1,94 @@
 #include <chrono>
 #include <iostream>
 
+#include "bench_utils.hpp"
 #include "hash_table.hpp"
+#include "histogram.hpp"
+#include "memory_report.hpp"
+#include "hybrid_engine.hpp"
+#include "load_generator.hpp"
 #include "multi_index.hpp"
+#include "multi_radius.hpp"
+#include "result_cache.hpp"
+#include "scan_index.hpp"
 #include "sketch_trie.hpp"
+#include "validator.hpp"
 
 #include "cmdline.h"
 
 using namespace sketch_search;
 
-constexpr double ABORT_BORDER_IN_MS = 1000.0;
-
-class timer {
-  public:
-    using hrc = std::chrono::high_resolution_clock;
-
-    timer() = default;
+// Prints the hit rate since the last call and the memory of the cache
+void print_cache(result_cache& cache) {
+    std::cout << "    cache: hit rate " << cache.get_hit_rate() * 100.0 << "%; " << cache.num_entries() << " entries; "
+              << cache.get_bytes() << " / " << cache.get_capacity() << " bytes" << std::endl;
+    cache.reset_stats();
+}
 
-    template <class Duration>
-    double get() const {
-        return std::chrono::duration_cast<Duration>(hrc::now() - tp_).count();
+// Open-loop load test at increasing offered rates for each radius, until p99 exceeds the SLO.
+// The index may be a cached_index, whose cache is reported for each rate.
+template <class Index>
+int load_test(const Index& index, const std::vector<const uint8_t*>& queries, int min_errs, int max_errs,
+              int err_step, const cmdline::parser& p, result_cache* cache) {
+    auto rates = parse_list<double>(p.get<std::string>("load_qps"));
+    auto arrival = p.get<std::string>("arrival");
+    auto workers = p.get<int>("workers");
+    auto num_requests = p.get<uint64_t>("requests");
+    auto slo_us = p.get<double>("slo_us");
+
+    if (arrival != "poisson" and arrival != "constant") {
+        std::cerr << "error: invalid arrival " << arrival << std::endl;
+        return 1;
     }
-
-  private:
-    hrc::time_point tp_ = hrc::now();
-};
-
-std::vector<std::string> string_split(const std::string& s, char delim) {
-    std::vector<std::string> elems;
-    std::string item;
-    for (char ch : s) {
-        if (ch == delim) {
-            if (!item.empty()) elems.push_back(item);
-            item.clear();
-        } else {
-            item += ch;
+    for (double qps : rates) {
+        if (!(0.0 < qps)) {
+            std::cerr << "error: offered rate " << qps << " <= 0" << std::endl;
+            return 1;
         }
     }
-    if (!item.empty()) elems.push_back(item);
-    return elems;
-}
-
-std::tuple<int, int, int> parse_range(const std::string& range_str) {
-    auto elems = string_split(range_str, ':');
-    if (elems.size() == 1) {
-        int max = std::stoi(elems[0]);
-        return {0, max, 1};
-    }
-    if (elems.size() == 2) {
-        int min = std::stoi(elems[0]);
-        int max = std::stoi(elems[1]);
-        return {min, max, 1};
+    if (queries.empty()) {
+        std::cerr << "error: queries is empty" << std::endl;
+        return 1;
     }
-    if (elems.size() == 3) {
-        int min = std::stoi(elems[0]);
-        int max = std::stoi(elems[1]);
-        int stp = std::stoi(elems[2]);
-        return {min, max, stp};
+    std::sort(rates.begin(), rates.end());
+
+    load_generator gen(arrival == "poisson" ? load_generator::arrivals::POISSON : load_generator::arrivals::CONSTANT,
+                       workers, num_requests);
+
+    std::cout << "Now load testing with " << arrival << " arrivals, " << workers << " workers, and SLO p99 <= "
+              << slo_us << " us..." << std::endl;
+
+    for (int errs = min_errs; errs <= max_errs; errs += err_step) {
+        double sustainable_qps = 0.0;
+        for (double qps : rates) {
+            const auto ret = gen.run(index, queries, errs, qps);
+            const double p99_us = ret.hist.get_percentile(99.0) / 1000.0;
+            std::cout << "--> " << errs << " errs; " << qps << " qps offered; " << ret.achieved_qps << " qps achieved"
+                      << std::endl;
+            std::cout << "    latency in us: ";
+            for (double percentile : {50.0, 90.0, 99.0, 99.9}) {
+                std::cout << "p" << percentile << " " << ret.hist.get_percentile(percentile) / 1000.0 << "; ";
+            }
+            std::cout << "max " << ret.hist.get_max() / 1000.0 << std::endl;
+            // Large lags mean that the generator (e.g., timer or scheduler) inflates the latencies
+            std::cout << "    timer lag in us: p50 " << ret.lag_hist.get_percentile(50.0) / 1000.0 << "; p99 "
+                      << ret.lag_hist.get_percentile(99.0) / 1000.0 << std::endl;
+            if (cache) {
+                print_cache(*cache);
+            }
+            if (slo_us < p99_us) {
+                break;
+            }
+            sustainable_qps = qps;
+        }
+        std::cout << "    sustainable: ";
+        if (sustainable_qps == 0.0) {
+            std::cout << "none of the rates" << std::endl;
+        } else {
+            std::cout << sustainable_qps << " qps" << std::endl;
+        }
     }
-
-    std::cerr << "error: invalid format of range string " << range_str << std::endl;
-    exit(1);
+    return 0;
 }
 
 template <class Index>
@@ -72,9 +100,21 @@ int bench_index(const cmdline::parser& p) {
     auto dim = p.get<int>("dim");
     auto bits = p.get<int>("bits");
     auto blocks = p.get<int>("blocks");
+    auto matches = p.get<int>("matches");
     auto errs_range = p.get<std::string>("errs_range");
+    auto count_only = p.get<bool>("count_only");
+    auto multi_radius = p.get<bool>("multi_radius");
+    auto cache_mb = p.get<double>("cache_mb");
     auto validation = p.get<bool>("validation");
     auto suf_thr = p.get<float>("suf_thr");
+    auto threads = p.get<int>("threads");
+    auto load_factor = p.get<float>("load_factor");
+    auto pfx_filter = p.get<bool>("pfx_filter");
+    auto dump_fn = p.get<std::string>("dump_fn");
+    auto perf_enabled = p.get<bool>("perf");
+    auto mem_fn = p.get<std::string>("mem_fn");
+    auto shape_fn = p.get<std::string>("shape_fn");
+    auto truth_fn = p.get<std::string>("truth_fn");
 
     if (dim == 0 or MAX_DIM < dim) {
         std::cerr << "error: dim == 0 or MAX_DIM < dim" << std::endl;
@@ -85,8 +125,20 @@ int bench_index(const cmdline::parser& p) {
         return 1;
     }
 
+    int min_errs, max_errs, err_step;
+    std::tie(min_errs, max_errs, err_step) = parse_range(errs_range);
+
     std::cout << "### " << short_realname<Index>() << " ###" << std::endl;
 
+    std::unique_ptr<perf_counters> perf;
+    if (perf_enabled) {
+        perf = std::make_unique<perf_counters>();
+        if (!perf->is_any_available()) {
+            std::cerr << "warning: hardware performance counters are unavailable" << std::endl;
+            perf.reset();
+        }
+    }
+
     Index index;
     std::vector<uint8_t> keys_buf;
     std::vector<const uint8_t*> keys;
@@ -97,7 +149,12 @@ int bench_index(const cmdline::parser& p) {
     conf.dim = dim;
     conf.bits = bits;
     conf.blocks = blocks;
+    conf.matches = matches;
+    conf.errs = max_errs;
+    conf.threads = threads;
     conf.suf_thr = suf_thr;
+    conf.load_factor = load_factor;
+    conf.pfx_filter = pfx_filter;
     conf.rep_type = node_reps::HYBRID;
 
     if (is_file_exist(base_fn)) {
@@ -112,13 +169,28 @@ int bench_index(const cmdline::parser& p) {
 
     if (!index_fn.empty()) {
         std::ostringstream oss;
-        oss << index_fn << "." << dim << "m" << bits << "b" << blocks << "B." << name;
+        oss << index_fn << "." << dim << "m" << bits << "b" << blocks << "B";
+        if (matches > 1) {
+            oss << matches << "t";
+        }
+        if (name == "hybrid") {
+            oss << max_errs << "e";
+        }
+        if (pfx_filter) {
+            oss << "P";
+        }
+        oss << "." << name;
         index_fn = oss.str();
     }
 
     if (is_file_exist(index_fn)) {
         std::cout << "Now loading index" << std::endl;
-        sdsl::load_from_file(index, index_fn);
+        try {
+            sdsl::load_from_file(index, index_fn);
+        } catch (const std::exception& ex) {
+            std::cerr << "error: cannot load " << index_fn << ": " << ex.what() << std::endl;
+            return 1;
+        }
     } else {
         if (keys.empty()) {
             std::cerr << "error: keys is empty" << std::endl;
@@ -126,9 +198,18 @@ int bench_index(const cmdline::parser& p) {
         }
         std::cout << "Now constructing index" << std::endl;
         timer t;
+        if (perf) {
+            perf->start();
+        }
         index.build(keys, conf);
-        double elapsed = t.get<std::chrono::seconds>();
+        if (perf) {
+            perf->stop();
+        }
+        double elapsed = t.get<std::chrono::milliseconds>() / 1000.0;
         std::cout << "--> " << elapsed << " sec" << std::endl;
+        if (perf) {
+            print_perf(*perf, double(keys.size()), "key");
+        }
         if (!index_fn.empty()) {
             std::cout << "Now writing " << index_fn << std::endl;
             sdsl::store_to_file(index, index_fn);
@@ -140,17 +221,48 @@ int bench_index(const cmdline::parser& p) {
         std::cout << "--> " << bytes << " bytes; " << bytes / (1024.0 * 1024.0) << " MiB" << std::endl;
     }
 
+    if (!mem_fn.empty()) {
+        memory_report report(index);
+        report.write_table(std::cout);
+        std::ofstream ofs(mem_fn);
+        if (!ofs) {
+            std::cerr << "open error: " << mem_fn << std::endl;
+            return 1;
+        }
+        report.write_json(ofs);
+        std::cout << "Wrote memory report to " << mem_fn << std::endl;
+    }
+
     index.show_stats(std::cout);
 
+    if (!shape_fn.empty()) {
+        std::ofstream ofs(shape_fn);
+        if (!ofs) {
+            std::cerr << "open error: " << shape_fn << std::endl;
+            return 1;
+        }
+        ofs << "block,stat,key,value\n";
+        index.write_shape_csv(ofs, 0);
+        std::cout << "Wrote trie shape to " << shape_fn << std::endl;
+    }
+
     std::cout << "Now loading queries..." << std::endl;
     queries_buf = load_sketches(query_fn, conf);
     queries = extract_ptrs(queries_buf, conf);
     std::cout << "--> " << queries.size() << " queries" << std::endl;
 
-    int min_errs, max_errs, err_step;
-    std::tie(min_errs, max_errs, err_step) = parse_range(errs_range);
+    std::unique_ptr<result_cache> cache;
+    if (0.0 < cache_mb) {
+        cache = std::make_unique<result_cache>(uint64_t(cache_mb * (1 << 20)));
+    }
 
-    auto searcher = index.make_searcher();
+    if (!p.get<std::string>("load_qps").empty()) {
+        if (cache) {
+            return load_test(cached_index<Index>(index, *cache), queries, min_errs, max_errs, err_step, p,
+                             cache.get());
+        }
+        return load_test(index, queries, min_errs, max_errs, err_step, p, nullptr);
+    }
 
     if (validation) {
         if (keys.empty()) {
@@ -158,64 +270,149 @@ int bench_index(const cmdline::parser& p) {
             return 1;
         }
 
-        std::cout << "Now validating with " << (min_errs + max_errs) / 2 << " errs..." << std::endl;
-
-        stat_t stat;
-        for (size_t j = 0; j < queries.size(); ++j) {
-            auto& ret = searcher(queries[j], min_errs, stat);
-            std::vector<score_t> searched_ans(ret.begin(), ret.end());
-
-            std::vector<score_t> true_ans;
-            for (uint32_t i = 0; i < keys.size(); ++i) {
-                int hamdist = get_hamdist(keys[i], queries[j], dim, min_errs);
-                if (hamdist <= min_errs) {
-                    true_ans.push_back({i, hamdist});
-                }
-            }
-
-            if (searched_ans.size() != true_ans.size()) {
-                std::cerr << "validation error: searched_ans.size() != true_ans.size() -> " << searched_ans.size()
-                          << " != " << true_ans.size() << std::endl;
-                std::cerr << "  at " << j << "-th query: ";
-                print_ints(std::cerr, queries[j], queries[j] + dim, nullptr);
-                return 1;
+        ground_truth truth;
+        const uint64_t fingerprint = ground_truth::get_fingerprint(keys, queries, conf);
+        if (is_file_exist(truth_fn)) {
+            sdsl::load_from_file(truth, truth_fn);
+        }
+        if (truth.is_valid_for(fingerprint, max_errs)) {
+            std::cout << "Loaded ground truth from " << truth_fn << std::endl;
+        } else {
+            std::cout << "Now computing ground truth with " << max_errs << " errs..." << std::endl;
+            timer t;
+            truth.build(keys, queries, conf, max_errs);
+            std::cout << "--> " << t.get<std::chrono::milliseconds>() / 1000.0 << " sec" << std::endl;
+            if (!truth_fn.empty()) {
+                sdsl::store_to_file(truth, truth_fn);
+                std::cout << "Wrote ground truth to " << truth_fn << std::endl;
             }
+        }
 
-            std::sort(searched_ans.begin(), searched_ans.end(),
-                      [](const score_t& lhs, const score_t& rhs) { return lhs.id < rhs.id; });
+        std::cout << "Now validating..." << std::endl;
 
-            for (uint32_t i = 0; i < searched_ans.size(); ++i) {
-                if (searched_ans[i].id != true_ans[i].id or searched_ans[i].errs != true_ans[i].errs) {
-                    std::cerr << "validation error: searched_ans[i].id != true_ans[i].id for i = " << i << std::endl;
-                    std::cerr << "  at " << j << "-th query: ";
-                    print_ints(std::cerr, queries[j], queries[j] + dim, nullptr);
-                    return 1;
+        size_t num_mismatches = 0;
+        for (int errs = min_errs; errs <= max_errs; errs += err_step) {
+            const auto mismatches = validate(index, queries, truth, errs, threads);
+            for (const auto& m : mismatches) {
+                std::cerr << "validation error: " << errs << " errs; " << m.query << "-th query; id " << m.id << "; ";
+                if (m.searched_errs < 0) {
+                    std::cerr << "missing (" << m.true_errs << " errs)" << std::endl;
+                } else if (m.true_errs < 0) {
+                    std::cerr << "unexpected (" << m.searched_errs << " errs)" << std::endl;
+                } else {
+                    std::cerr << m.searched_errs << " errs but " << m.true_errs << " errs" << std::endl;
                 }
             }
+            std::cout << "--> " << errs << " errs; " << mismatches.size() << " mismatches" << std::endl;
+            num_mismatches += mismatches.size();
+        }
+
+        if (num_mismatches != 0) {
+            return 1;
         }
         std::cout << "--> No problem!!" << std::endl;
         return 0;
     }
 
+    auto searcher = index.make_searcher();
+    set_query_threads(searcher, threads);
+
+    // Answers of the queries through the cache, if any
+    std::unique_ptr<cached_index<Index>> cached;
+    std::unique_ptr<typename cached_index<Index>::searcher> cached_searcher;
+    if (cache) {
+        cached = std::make_unique<cached_index<Index>>(index, *cache);
+        cached_searcher = std::make_unique<typename cached_index<Index>::searcher>(cached->make_searcher());
+    }
+
     {
         std::cout << "Now simlarity searching..." << std::endl;
 
+        std::ofstream dump_ofs;
+        if (!dump_fn.empty()) {
+            dump_ofs.open(dump_fn);
+            if (!dump_ofs) {
+                std::cerr << "open error: " << dump_fn << std::endl;
+                return 1;
+            }
+            dump_ofs << "errs\tquery\tlatency_ns\tnum_ans\tnum_cands\n";
+        }
+
+        // (latency in ns, #answers, #candidates) of each query
+        std::vector<std::array<uint64_t, 3>> query_stats(queries.size());
+        latency_histogram hist;
+
         for (int errs = min_errs; errs <= max_errs; errs += err_step) {
             size_t num_ans = 0;
             stat_t stat;
+            hist.clear();
 
+            if (perf) {
+                perf->start();
+            }
             timer t;
             for (uint32_t i = 0; i < queries.size(); ++i) {
-                auto ret = searcher(queries[i], errs, stat);
-                num_ans += ret.size();
+                const size_t num_cands = stat.num_cands;
+                timer qt;
+                uint64_t n = 0;
+                if (cached_searcher) {
+                    n = count_only ? cached_searcher->count(queries[i], errs, stat)
+                                   : (*cached_searcher)(queries[i], errs, stat).size();
+                } else if (count_only) {
+                    n = searcher.count(queries[i], errs, stat);
+                } else {
+                    n = searcher(queries[i], errs, stat).size();
+                }
+                const uint64_t latency = uint64_t(qt.get<std::chrono::nanoseconds>());
+                hist.record(latency);
+                num_ans += n;
+                query_stats[i] = {latency, n, stat.num_cands - num_cands};
             }
             double elapsed = t.get<std::chrono::milliseconds>();
+            if (perf) {
+                perf->stop();
+            }
 
             std::cout << "--> " << errs << " errs; " << double(num_ans) / queries.size() << " ans; ";
             std::cout << double(stat.num_cands) / queries.size() << " cands; ";
-            // std::cout << double(stat.num_actnodes) / queries.size() << " actnodes; ";
+            if (stat.num_hashed + stat.num_scanned != 0) {
+                std::cout << stat.num_hashed << " hashed; " << stat.num_scanned << " scanned; ";
+            }
+#ifdef ENABLE_STATS
+            std::cout << double(stat.num_actnodes) / queries.size() << " actnodes; ";
+#endif
             std::cout << elapsed / queries.size() << " ms" << std::endl;
 
+#ifdef ENABLE_STATS
+            {
+                const double n = double(queries.size());
+                std::cout << "    per query: " << stat.num_dense_nodes / n << " dense; " << stat.num_dht_nodes / n
+                          << " dht; " << stat.num_list_nodes / n << " list; " << stat.num_sparse_nodes / n
+                          << " sparse; " << stat.num_ranks / n << " ranks; " << stat.num_selects / n << " selects; "
+                          << stat.num_sufs_matched / n << " / " << stat.num_sufs_scanned / n << " sufs matched; "
+                          << stat.num_ids / n << " ids" << std::endl;
+            }
+#endif
+
+            std::cout << "    latency in us: ";
+            for (double percentile : {50.0, 90.0, 99.0, 99.9}) {
+                std::cout << "p" << percentile << " " << hist.get_percentile(percentile) / 1000.0 << "; ";
+            }
+            std::cout << "max " << hist.get_max() / 1000.0 << std::endl;
+            if (cache) {
+                print_cache(*cache);
+            }
+            if (perf) {
+                print_perf(*perf, double(queries.size()), "query");
+            }
+
+            if (dump_ofs) {
+                for (uint32_t i = 0; i < queries.size(); ++i) {
+                    dump_ofs << errs << '\t' << i << '\t' << query_stats[i][0] << '\t' << query_stats[i][1] << '\t'
+                             << query_stats[i][2] << '\n';
+                }
+            }
+
             if (ABORT_BORDER_IN_MS * queries.size() < elapsed) {
                 std::cout << "**** forced termination due to ABORT_BORDER_IN_MS!! ****" << std::endl;
                 break;
@@ -223,21 +420,70 @@ int bench_index(const cmdline::parser& p) {
         }
     }
 
+    if (multi_radius) {
+        std::cout << "Now multi-radius searching..." << std::endl;
+
+        multi_radius_searcher<Index> mr_searcher(index);
+        std::vector<uint64_t> num_ans(max_errs + 1, 0);
+        stat_t stat;
+        latency_histogram hist;
+
+        timer t;
+        for (uint32_t i = 0; i < queries.size(); ++i) {
+            timer qt;
+            mr_searcher(queries[i], max_errs, stat);
+            hist.record(uint64_t(qt.get<std::chrono::nanoseconds>()));
+            for (int errs = min_errs; errs <= max_errs; errs += err_step) {
+                num_ans[errs] += mr_searcher.num_within(errs);
+            }
+        }
+        const double elapsed = t.get<std::chrono::microseconds>() / 1000.0;
+
+        for (int errs = min_errs; errs <= max_errs; errs += err_step) {
+            std::cout << "--> " << errs << " errs; " << double(num_ans[errs]) / queries.size() << " ans" << std::endl;
+        }
+        std::cout << "--> all radii; " << elapsed / queries.size() << " ms" << std::endl;
+        std::cout << "    latency in us: ";
+        for (double percentile : {50.0, 90.0, 99.0, 99.9}) {
+            std::cout << "p" << percentile << " " << hist.get_percentile(percentile) / 1000.0 << "; ";
+        }
+        std::cout << "max " << hist.get_max() / 1000.0 << std::endl;
+    }
+
     return 0;
 }
 
 int main(int argc, char* argv[]) {
     cmdline::parser p;
-    p.add<std::string>("name", 'n', "index name (hash | trie)", true);
+    p.add<std::string>("name", 'n', "index name (hash | trie | hybrid | scan)", true);
     p.add<std::string>("index_fn", 'i', "input/output file name of index", true);
     p.add<std::string>("base_fn", 'd', "input file name of database sketches", true);
     p.add<std::string>("query_fn", 'q', "input file name of query sketches", true);
     p.add<int>("dim", 'm', "dimension (<= 64)", false, 32);
     p.add<int>("bits", 'b', "#bits of alphabet (<= 8)", false, 2);
     p.add<int>("blocks", 'B', "#blocks (B=1 means to use single index)", false, 1);
+    p.add<int>("matches", 't', "#blocks required to match in multi-index (1 <= t <= B)", false, 1);
     p.add<std::string>("errs_range", 'e', "range of errs (min:max:step)", false, "1:5:1");
+    p.add<bool>("count_only", 'c', "count answers without reporting their IDs", false, false);
+    p.add<bool>("multi_radius", 'M', "also search for all the radii at once by one search within max errs", false,
+                false);
+    p.add<double>("cache_mb", 'C', "MiB of result cache in front of the searchers (0 means no cache)", false, 0.0);
     p.add<bool>("validation", 'v', "validation", false, false);
+    p.add<std::string>("truth_fn", 'g', "input/output file name of ground truth for validation", false, "");
     p.add<float>("suf_thr", 's', "suf_thr", false, 2.0);
+    p.add<float>("load_factor", 'l', "load factor of hash table (0 < l <= 1)", false, 0.875);
+    p.add<bool>("pfx_filter", 'P', "prefix filter of hash table", false, false);
+    p.add<std::string>("dump_fn", 'o', "output file name of per-query latencies (TSV)", false, "");
+    p.add<std::string>("mem_fn", 'r', "output file name of memory report (JSON)", false, "");
+    p.add<std::string>("shape_fn", 'S', "output file name of trie shape statistics (CSV)", false, "");
+    p.add<std::string>("load_qps", 'L', "offered rates (comma separated) of open-loop load test instead of search",
+                       false, "");
+    p.add<std::string>("arrival", 'A', "arrivals of load test (poisson | constant)", false, "poisson");
+    p.add<int>("workers", 'W', "#worker threads of load test", false, 1);
+    p.add<uint64_t>("requests", 'R', "#requests per rate of load test", false, 10000);
+    p.add<double>("slo_us", 'U', "SLO of p99 latency in microseconds for load test", false, 1000.0);
+    p.add<bool>("perf", 'p', "hardware performance counters (Linux only)", false, false);
+    p.add<int>("threads", 'T', "#threads for construction (and queries of scan)", false, int(std::thread::hardware_concurrency()));
     p.parse_check(argc, argv);
 
     auto name = p.get<std::string>("name");
@@ -250,6 +496,12 @@ int main(int argc, char* argv[]) {
         if (name == "trie") {
             return bench_index<sketch_trie>(p);
         }
+        if (name == "hybrid") {
+            return bench_index<hybrid_engine>(p);
+        }
+        if (name == "scan") {
+            return bench_index<scan_index>(p);
+        }
     } else {
         if (name == "hash") {
             return bench_index<multi_index<hash_table>>(p);
@@ -257,6 +509,9 @@ int main(int argc, char* argv[]) {
         if (name == "trie") {
             return bench_index<multi_index<sketch_trie>>(p);
         }
+        if (name == "hybrid") {
+            return bench_index<multi_index<hybrid_engine>>(p);
+        }
     }
 
     return 1;
@@ -0,0 +1,514 @@
+#include <algorithm>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <mutex>
+
+#include "bench_utils.hpp"
+#include "hash_table.hpp"
+#include "histogram.hpp"
+#include "hybrid_engine.hpp"
+#include "multi_index.hpp"
+#include "scan_index.hpp"
+#include "server_protocol.hpp"
+#include "sketch_trie.hpp"
+
+#include "cmdline.h"
+
+using namespace sketch_search;
+
+static constexpr uint32_t QUERIES_PER_JOB = 64;  // a batch is split into jobs of this size for the workers
+
+// Type-erased index and searcher, so that indexes of different types can be served and swapped
+class any_searcher {
+  public:
+    virtual ~any_searcher() = default;
+    // Replaces answers with those of q within max_errs
+    virtual void operator()(const uint8_t* q, int max_errs, stat_t& stat, std::vector<score_t>& answers) = 0;
+};
+
+class any_index {
+  public:
+    virtual ~any_index() = default;
+    virtual config_t get_config() const = 0;
+    virtual uint64_t num_keys() const = 0;
+    virtual std::unique_ptr<any_searcher> make_searcher() const = 0;
+};
+
+template <class Index>
+class typed_index : public any_index {
+  public:
+    // Throws if the file cannot be read as an Index, including when bytes are left over after it
+    explicit typed_index(const std::string& fn) {
+        std::ifstream ifs(fn, std::ios::binary);
+        m_index.load(ifs);
+        if (!ifs || ifs.peek() != std::ifstream::traits_type::eof()) {
+            throw std::runtime_error("not an index file of this type");
+        }
+    }
+
+    config_t get_config() const override {
+        return m_index.get_config();
+    }
+    uint64_t num_keys() const override {
+        return m_index.num_keys();
+    }
+    std::unique_ptr<any_searcher> make_searcher() const override {
+        return std::make_unique<typed_searcher>(m_index.make_searcher());
+    }
+
+  private:
+    Index m_index;
+
+    class typed_searcher : public any_searcher {
+      public:
+        explicit typed_searcher(typename Index::searcher&& searcher) : m_searcher(std::move(searcher)) {}
+        void operator()(const uint8_t* q, int max_errs, stat_t& stat, std::vector<score_t>& answers) override {
+            answers.clear();
+            m_searcher(q, max_errs, stat, [&](uint32_t id, int errs) {
+                answers.push_back({id, errs});
+                return true;
+            });
+        }
+
+      private:
+        typename Index::searcher m_searcher;
+    };
+};
+
+template <class Index>
+std::shared_ptr<const any_index> make_index_(const std::string& fn) {
+    return std::make_shared<typed_index<Index>>(fn);
+}
+
+// Loads an index file of the type given by name and blocks, as in search. Never throws; on failure returns
+// nullptr and sets error.
+std::shared_ptr<const any_index> load_index(const std::string& name, int blocks, const std::string& fn,
+                                            std::string& error) {
+    if (!is_file_exist(fn)) {
+        error = "no such file";
+        return nullptr;
+    }
+    try {
+        if (blocks == 1) {
+            if (name == "hash") {
+                return make_index_<hash_table>(fn);
+            }
+            if (name == "trie") {
+                return make_index_<sketch_trie>(fn);
+            }
+            if (name == "hybrid") {
+                return make_index_<hybrid_engine>(fn);
+            }
+            if (name == "scan") {
+                return make_index_<scan_index>(fn);
+            }
+        } else {
+            if (name == "hash") {
+                return make_index_<multi_index<hash_table>>(fn);
+            }
+            if (name == "trie") {
+                return make_index_<multi_index<sketch_trie>>(fn);
+            }
+            if (name == "hybrid") {
+                return make_index_<multi_index<hybrid_engine>>(fn);
+            }
+        }
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        return nullptr;
+    }
+    error = "unknown index type";
+    return nullptr;
+}
+
+// An index served at a position, which is replaced atomically. Requests in flight keep the old index alive
+// through their own references, so no request is dropped by a swap.
+struct index_slot {
+    std::string name;
+    int blocks;
+    std::shared_ptr<const any_index> index;  // accessed by std::atomic_load/store
+    std::mutex reload_mutex;  // serializes reloads
+};
+
+// A batch of queries split into jobs
+struct request_t {
+    std::shared_ptr<const any_index> index;
+    size_t slot;
+    const uint8_t* queries;
+    uint32_t dim;
+    int max_errs;
+    std::vector<std::vector<score_t>> answers;
+    uint32_t num_left;  // #jobs not finished, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable done;
+};
+
+struct job_t {
+    request_t* request;
+    uint32_t beg;
+    uint32_t end;
+};
+
+class job_queue {
+  public:
+    void push(const job_t& job) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(job);
+            m_max_depth = std::max(m_max_depth, m_jobs.size());
+        }
+        m_cond.notify_one();
+    }
+
+    // Returns false if the queue is closed. If woken up by wake_all() since the epoch of the caller without
+    // any job, job.request is set to nullptr.
+    bool pop(job_t& job, uint64_t& epoch) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [&] { return m_closed or !m_jobs.empty() or m_epoch != epoch; });
+        epoch = m_epoch;
+        if (m_jobs.empty()) {
+            job.request = nullptr;
+            return !m_closed;
+        }
+        job = m_jobs.front();
+        m_jobs.pop_front();
+        return true;
+    }
+
+    // Wakes up all the waiting workers, e.g., to drop their references to a swapped-out index
+    void wake_all() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_epoch;
+        }
+        m_cond.notify_all();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cond.notify_all();
+    }
+
+    size_t get_depth() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_jobs.size();
+    }
+    size_t get_max_depth() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_max_depth;
+    }
+
+  private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<job_t> m_jobs;
+    size_t m_max_depth = 0;
+    uint64_t m_epoch = 0;
+    bool m_closed = false;
+};
+
+class server_metrics {
+  public:
+    void record(uint64_t num_queries, uint64_t latency_ns) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_num_queries += num_queries;
+        ++m_num_requests;
+        m_hist.record(latency_ns);
+    }
+    void record_reload() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_num_reloads;
+    }
+
+    std::string to_string(const job_queue& jobs) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const double uptime = m_timer.get<std::chrono::milliseconds>() / 1000.0;
+        std::ostringstream oss;
+        oss << "uptime_sec " << uptime << '\n';
+        oss << "num_requests " << m_num_requests << '\n';
+        oss << "num_queries " << m_num_queries << '\n';
+        oss << "num_reloads " << m_num_reloads << '\n';
+        oss << "qps " << (uptime == 0.0 ? 0.0 : m_num_queries / uptime) << '\n';
+        for (double percentile : {50.0, 90.0, 99.0, 99.9}) {
+            oss << "request_latency_us_p" << percentile << ' ' << m_hist.get_percentile(percentile) / 1000.0 << '\n';
+        }
+        oss << "request_latency_us_max " << m_hist.get_max() / 1000.0 << '\n';
+        oss << "queue_depth " << jobs.get_depth() << '\n';
+        oss << "queue_depth_max " << jobs.get_max_depth() << '\n';
+        return oss.str();
+    }
+
+  private:
+    mutable std::mutex m_mutex;
+    timer m_timer;
+    uint64_t m_num_queries = 0;
+    uint64_t m_num_requests = 0;
+    uint64_t m_num_reloads = 0;
+    latency_histogram m_hist;
+};
+
+class query_server {
+  public:
+    query_server(std::vector<std::unique_ptr<index_slot>>&& slots, int workers) : m_slots(std::move(slots)) {
+        for (int w = 0; w < std::max(workers, 1); ++w) {
+            m_workers.emplace_back([this] { work_(); });
+        }
+    }
+
+    ~query_server() {
+        m_jobs.close();
+        for (auto& w : m_workers) {
+            w.join();
+        }
+    }
+
+    // Serves the requests of a connection until it is closed
+    void serve(int fd) {
+        std::vector<uint8_t> payload;
+        std::vector<uint8_t> response;
+        protocol::header_t header;
+
+        while (protocol::read_full(fd, &header, sizeof(header))) {
+            if (protocol::MAX_PAYLOAD < header.size) {
+                protocol::send_text(fd, protocol::ERROR, "too large payload");
+                break;
+            }
+            payload.resize(header.size);
+            if (!protocol::read_full(fd, payload.data(), payload.size())) {
+                break;
+            }
+
+            bool ok = false;
+            switch (header.code) {
+                case protocol::QUERY:
+                    ok = query_(fd, header, payload, response);
+                    break;
+                case protocol::STATS:
+                    ok = protocol::send_text(fd, protocol::OK, m_metrics.to_string(m_jobs));
+                    break;
+                case protocol::RELOAD:
+                    ok = reload_(fd, header, std::string(payload.begin(), payload.end()));
+                    break;
+                default:
+                    ok = protocol::send_text(fd, protocol::ERROR, "invalid op");
+                    break;
+            }
+            if (!ok) {
+                break;
+            }
+        }
+        ::close(fd);
+    }
+
+  private:
+    std::vector<std::unique_ptr<index_slot>> m_slots;
+    std::vector<std::thread> m_workers;
+    job_queue m_jobs;
+    server_metrics m_metrics;
+
+    bool query_(int fd, const protocol::header_t& header, const std::vector<uint8_t>& payload,
+                std::vector<uint8_t>& response) {
+        if (m_slots.size() <= header.index) {
+            return protocol::send_text(fd, protocol::ERROR, "invalid index");
+        }
+
+        timer t;
+
+        request_t request;
+        request.slot = header.index;
+        request.index = std::atomic_load(&m_slots[header.index]->index);
+        request.dim = uint32_t(request.index->get_config().dim);
+        // A radius above dim (up to 255 in the header) has the same answers as dim, and the searchers may
+        // assume that max_errs <= dim, e.g., for the tables of signatures
+        request.max_errs = std::min<int>(header.max_errs, int(request.dim));
+        request.queries = payload.data();
+
+        if (payload.size() % request.dim != 0) {
+            return protocol::send_text(fd, protocol::ERROR, "payload is not a multiple of dim");
+        }
+        // Out-of-range integers would spill into the neighbors in packed codes or index out of trie nodes
+        const int max_value = (1 << request.index->get_config().bits) - 1;
+        if (std::any_of(payload.begin(), payload.end(), [&](uint8_t c) { return max_value < c; })) {
+            return protocol::send_text(fd, protocol::ERROR, "query integer out of range of bits");
+        }
+        const uint32_t num_queries = uint32_t(payload.size() / request.dim);
+        request.answers.resize(num_queries);
+        request.num_left = (num_queries + QUERIES_PER_JOB - 1) / QUERIES_PER_JOB;
+
+        for (uint32_t beg = 0; beg < num_queries; beg += QUERIES_PER_JOB) {
+            m_jobs.push({&request, beg, std::min(beg + QUERIES_PER_JOB, num_queries)});
+        }
+        {
+            std::unique_lock<std::mutex> lock(request.mutex);
+            request.done.wait(lock, [&] { return request.num_left == 0; });
+        }
+
+        response.clear();
+        for (const auto& answers : request.answers) {
+            const uint32_t num_ans = uint32_t(answers.size());
+            const size_t pos = response.size();
+            response.resize(pos + sizeof(uint32_t) + num_ans * protocol::ANSWER_BYTES);
+            uint8_t* ptr = response.data() + pos;
+            std::memcpy(ptr, &num_ans, sizeof(uint32_t));
+            ptr += sizeof(uint32_t);
+            for (const auto& a : answers) {
+                std::memcpy(ptr, &a.id, sizeof(uint32_t));
+                ptr[sizeof(uint32_t)] = uint8_t(a.errs);
+                ptr += protocol::ANSWER_BYTES;
+            }
+        }
+        m_metrics.record(num_queries, uint64_t(t.get<std::chrono::nanoseconds>()));
+
+        protocol::header_t res_header = {protocol::OK, header.index, header.max_errs, 0, uint32_t(response.size())};
+        return protocol::send_message(fd, res_header, response.data());
+    }
+
+    // Loads the new index while the old one keeps serving, and then swaps them
+    bool reload_(int fd, const protocol::header_t& header, const std::string& fn) {
+        if (m_slots.size() <= header.index) {
+            return protocol::send_text(fd, protocol::ERROR, "invalid index");
+        }
+        index_slot& slot = *m_slots[header.index];
+        std::lock_guard<std::mutex> lock(slot.reload_mutex);
+
+        timer t;
+        std::string error;
+        auto index = load_index(slot.name, slot.blocks, fn, error);
+        if (!index) {
+            return protocol::send_text(fd, protocol::ERROR, "cannot load " + fn + ": " + error);
+        }
+        // Clients size queries and radii by the served index, so the new one must agree with it
+        const config_t old_conf = std::atomic_load(&slot.index)->get_config();
+        const config_t new_conf = index->get_config();
+        if (old_conf.dim != new_conf.dim || old_conf.bits != new_conf.bits) {
+            return protocol::send_text(fd, protocol::ERROR, "cannot load " + fn + ": dim or bits differ");
+        }
+        std::atomic_store(&slot.index, index);
+        m_jobs.wake_all();
+        m_metrics.record_reload();
+
+        std::ostringstream oss;
+        oss << "reloaded " << fn << " with " << index->num_keys() << " keys in "
+            << t.get<std::chrono::milliseconds>() / 1000.0 << " sec";
+        std::cout << oss.str() << std::endl;
+        return protocol::send_text(fd, protocol::OK, oss.str());
+    }
+
+    void work_() {
+        // Per-thread searchers of each slot, recreated when the slot's index is swapped
+        std::vector<std::shared_ptr<const any_index>> indexes(m_slots.size());
+        std::vector<std::unique_ptr<any_searcher>> searchers(m_slots.size());
+        stat_t stat;
+
+        uint64_t epoch = 0;
+        for (job_t job; m_jobs.pop(job, epoch);) {
+            // Drops the references to swapped-out indexes, so that each is freed once its requests in flight
+            // are finished. A searcher is destroyed before its index.
+            for (size_t s = 0; s < m_slots.size(); ++s) {
+                if (indexes[s] and indexes[s] != std::atomic_load(&m_slots[s]->index)) {
+                    searchers[s].reset();
+                    indexes[s].reset();
+                }
+            }
+            if (job.request == nullptr) {
+                continue;
+            }
+
+            request_t& request = *job.request;
+            if (indexes[request.slot] != request.index) {
+                searchers[request.slot] = request.index->make_searcher();
+                indexes[request.slot] = request.index;
+            }
+            auto& searcher = *searchers[request.slot];
+            for (uint32_t i = job.beg; i < job.end; ++i) {
+                searcher(request.queries + size_t(i) * request.dim, request.max_errs, stat, request.answers[i]);
+            }
+
+            bool is_last = false;
+            {
+                std::lock_guard<std::mutex> lock(request.mutex);
+                is_last = --request.num_left == 0;
+            }
+            if (is_last) {
+                request.done.notify_one();
+            }
+        }
+    }
+};
+
+static volatile std::sig_atomic_t g_stop = 0;
+static int g_listen_fd = -1;
+
+void handle_signal(int) {
+    g_stop = 1;
+    ::shutdown(g_listen_fd, SHUT_RDWR);
+}
+
+int main(int argc, char* argv[]) {
+    cmdline::parser p;
+    p.add<std::string>("socket_fn", 's', "file name of Unix domain socket", true);
+    p.add<std::string>("indexes", 'x', "indexes to serve (name:blocks:index_fn), comma separated", true);
+    p.add<int>("workers", 'W', "#worker threads", false, int(std::thread::hardware_concurrency()));
+    p.parse_check(argc, argv);
+
+    auto socket_fn = p.get<std::string>("socket_fn");
+    auto workers = p.get<int>("workers");
+
+    std::vector<std::unique_ptr<index_slot>> slots;
+    for (const auto& spec : string_split(p.get<std::string>("indexes"), ',')) {
+        auto elems = string_split(spec, ':');
+        if (elems.size() != 3) {
+            std::cerr << "error: invalid index spec " << spec << std::endl;
+            return 1;
+        }
+        auto slot = std::make_unique<index_slot>();
+        slot->name = elems[0];
+        slot->blocks = std::stoi(elems[1]);
+        std::cout << "Now loading " << elems[2] << std::endl;
+        std::string error;
+        slot->index = load_index(slot->name, slot->blocks, elems[2], error);
+        if (!slot->index) {
+            std::cerr << "error: cannot load " << spec << ": " << error << std::endl;
+            return 1;
+        }
+        std::cout << "--> index " << slots.size() << ": " << slot->index->num_keys() << " keys; dim "
+                  << slot->index->get_config().dim << std::endl;
+        slots.push_back(std::move(slot));
+    }
+    if (256 < slots.size()) {
+        std::cerr << "error: at most 256 indexes can be served" << std::endl;
+        return 1;
+    }
+
+    g_listen_fd = protocol::listen_unix(socket_fn);
+    if (g_listen_fd < 0) {
+        std::cerr << "error: cannot listen on " << socket_fn << std::endl;
+        return 1;
+    }
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+
+    query_server server(std::move(slots), workers);
+    std::cout << "Now serving on " << socket_fn << " with " << workers << " workers" << std::endl;
+
+    while (!g_stop) {
+        const int fd = ::accept(g_listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        std::thread([&server, fd] { server.serve(fd); }).detach();
+    }
+
+    ::close(g_listen_fd);
+    ::unlink(socket_fn.c_str());
+    std::cout << "Stopped" << std::endl;
+    // Connections still open are abandoned at exit
+    std::_Exit(0);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Binary protocol of the query server over a Unix domain socket, in the native byte order.
+//
+// A request is a header followed by size bytes of payload:
+//   - QUERY: queries of dim integers each (dim and bits of the index), searched within max_errs
+//   - STATS: no payload
+//   - RELOAD: the file name of a new index to replace the index
+// A response is a header whose first byte is the status, followed by size bytes of payload:
+//   - QUERY: for each query, #answers (4 bytes) followed by ID (4 bytes) and errs (1 byte) of each answer
+//   - STATS, RELOAD, or any error: a text message
+namespace protocol {
+
+enum ops : uint8_t { QUERY = 1, STATS = 2, RELOAD = 3 };
+enum statuses : uint8_t { OK = 0, ERROR = 1 };
+
+struct header_t {
+    uint8_t code;  // op of a request, or status of a response
+    uint8_t index;  // position of the index in the server
+    uint8_t max_errs;
+    uint8_t reserved;
+    uint32_t size;  // of payload in bytes
+};
+static_assert(sizeof(header_t) == 8, "header_t must be packed in 8 bytes");
+
+static constexpr size_t ANSWER_BYTES = sizeof(uint32_t) + sizeof(uint8_t);
+static constexpr uint32_t MAX_PAYLOAD = 1U << 30;
+
+inline bool read_full(int fd, void* buf, size_t n) {
+    auto ptr = static_cast<char*>(buf);
+    while (n != 0) {
+        const ssize_t r = ::read(fd, ptr, n);
+        if (r <= 0) {
+            if (r < 0 and errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += r;
+        n -= size_t(r);
+    }
+    return true;
+}
+
+inline bool write_full(int fd, const void* buf, size_t n) {
+    auto ptr = static_cast<const char*>(buf);
+    while (n != 0) {
+        const ssize_t r = ::send(fd, ptr, n, MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 and errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += r;
+        n -= size_t(r);
+    }
+    return true;
+}
+
+inline bool send_message(int fd, const header_t& header, const void* payload) {
+    return write_full(fd, &header, sizeof(header)) and write_full(fd, payload, header.size);
+}
+
+inline bool send_text(int fd, uint8_t code, const std::string& text) {
+    header_t header = {code, 0, 0, 0, uint32_t(text.size())};
+    return send_message(fd, header, text.data());
+}
+
+// Returns the file descriptor of the socket, or -1 on failure
+inline int connect_unix(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (sizeof(addr.sun_path) <= path.size()) {
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline int listen_unix(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (sizeof(addr.sun_path) <= path.size()) {
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 or ::listen(fd, SOMAXCONN) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}  // namespace protocol
+}  // namespace sketch_search
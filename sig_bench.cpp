@@ -0,0 +1,196 @@
+#include <algorithm>
+
+#include "sig_generator.hpp"
+#include "sig_size.hpp"
+#include "tab_hash.hpp"
+
+#include "cmdline.h"
+
+using namespace sketch_search;
+
+uint64_t fnv1a_hash(const uint8_t* key, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= key[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Enumerates all the signatures with exactly errs substitutions for each query and
+// calls hash_fn(q, sig) for each signature. Returns the number of signatures.
+template <class HashFn>
+uint64_t run(const std::vector<const uint8_t*>& queries, const config_t& conf, int errs, uint64_t& sink,
+             HashFn&& hash_fn) {
+    sig_generator gen;
+    uint64_t num_sigs = 0;
+    for (const uint8_t* q : queries) {
+        gen.set(q, conf.dim, conf.dim, conf.bits, errs);
+        while (gen.has_next()) {
+            sink ^= hash_fn(q, gen.next(), gen);
+            ++num_sigs;
+        }
+    }
+    return num_sigs;
+}
+
+// Checks that the signatures of each query are distinct and exactly errs away from the query,
+// which together with the number of signatures means that all of them are enumerated.
+// Also checks that the deltas reproduce the signatures.
+bool check(const std::vector<const uint8_t*>& queries, const config_t& conf, int errs) {
+    sig_generator gen;
+    std::vector<std::string> sigs;
+    for (size_t j = 0; j < queries.size(); ++j) {
+        const uint8_t* q = queries[j];
+        sigs.clear();
+        std::vector<uint8_t> cur(q, q + conf.dim);
+        gen.set(q, conf.dim, conf.dim, conf.bits, errs);
+        while (gen.has_next()) {
+            const uint8_t* sig = gen.next();
+            for (int r = 0; r < gen.get_num_deltas(); ++r) {
+                const auto& d = gen.get_deltas()[r];
+                if (cur[d.pos] != d.c_old) {
+                    std::cerr << "error: a delta is inconsistent at " << j << "-th query" << std::endl;
+                    return false;
+                }
+                cur[d.pos] = d.c_new;
+            }
+            if (!std::equal(cur.begin(), cur.end(), sig)) {
+                std::cerr << "error: the deltas do not reproduce a signature at " << j << "-th query" << std::endl;
+                return false;
+            }
+            if (get_hamdist(q, sig, conf.dim) != errs) {
+                std::cerr << "error: a signature is not " << errs << " errs away at " << j << "-th query" << std::endl;
+                return false;
+            }
+            sigs.emplace_back(reinterpret_cast<const char*>(sig), conf.dim);
+        }
+        std::sort(sigs.begin(), sigs.end());
+        if (std::adjacent_find(sigs.begin(), sigs.end()) != sigs.end()) {
+            std::cerr << "error: a signature is duplicated at " << j << "-th query" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::ios::sync_with_stdio(false);
+
+    cmdline::parser p;
+    p.add<std::string>("query_fn", 'q', "input file name of query sketches", true);
+    p.add<int>("dim", 'm', "dimension (<= 64)", false, 32);
+    p.add<int>("bits", 'b', "#bits of alphabet (<= 8)", false, 2);
+    p.add<int>("min_errs", 'e', "min errs", false, 1);
+    p.add<int>("max_errs", 'E', "max errs", false, 4);
+    p.add<bool>("check", 'c', "check that the signatures are distinct and errs away", false, false);
+    p.parse_check(argc, argv);
+
+    config_t conf;
+    conf.dim = p.get<int>("dim");
+    conf.bits = p.get<int>("bits");
+
+    auto queries_buf = load_sketches(p.get<std::string>("query_fn"), conf);
+    auto queries = extract_ptrs(queries_buf, conf);
+    std::cout << "--> " << queries.size() << " queries" << std::endl;
+
+    tab_hash hasher;
+    hasher.build(conf.dim, conf.bits);
+
+    auto gen_only = [&](const uint8_t*, const uint8_t* sig, const sig_generator&) -> uint64_t { return sig[0]; };
+    auto fnv1a = [&](const uint8_t*, const uint8_t* sig, const sig_generator&) -> uint64_t {
+        return fnv1a_hash(sig, conf.dim);
+    };
+    auto tab_full = [&](const uint8_t*, const uint8_t* sig, const sig_generator&) -> uint64_t {
+        return hasher(sig, conf.dim);
+    };
+    uint64_t cur_hash = 0;  // of the previous signature
+    auto tab_incr = [&](const uint8_t*, const uint8_t*, const sig_generator& gen) -> uint64_t {
+        const sig_generator::delta_t* deltas = gen.get_deltas();
+        for (int r = 0; r < gen.get_num_deltas(); ++r) {
+            cur_hash = hasher.update(cur_hash, deltas[r].pos, deltas[r].c_old, deltas[r].c_new);
+        }
+        return cur_hash;
+    };
+
+    std::cout << "Signatures per second (in millions)" << std::endl;
+    std::cout << "errs\tnum_sigs\tgen_only\tgen_batch\tfnv1a\ttab_full\ttab_incr" << std::endl;
+
+    for (int errs = p.get<int>("min_errs"); errs <= p.get<int>("max_errs"); ++errs) {
+        uint64_t sink = 0;
+        uint64_t num_sigs = 0;
+        std::cout << errs << "\t";
+
+        auto measure = [&](auto&& hash_fn) {
+            timer t;
+            num_sigs = run(queries, conf, errs, sink, hash_fn);
+            double elapsed = t.get<std::chrono::microseconds>();
+            return num_sigs / elapsed;
+        };
+
+        double gen_only_mps = measure(gen_only);
+
+        double gen_batch_mps = 0.0;
+        {
+            static constexpr size_t BATCH_SIZE = 64;
+            std::vector<uint8_t> batch(BATCH_SIZE * conf.dim);
+            sig_generator gen;
+            timer t;
+            num_sigs = 0;
+            for (const uint8_t* q : queries) {
+                gen.set(q, conf.dim, conf.dim, conf.bits, errs);
+                while (size_t n = gen.next_batch(batch.data(), BATCH_SIZE)) {
+                    sink ^= batch[(n - 1) * conf.dim];
+                    num_sigs += n;
+                }
+            }
+            double elapsed = t.get<std::chrono::microseconds>();
+            gen_batch_mps = num_sigs / elapsed;
+        }
+
+        double fnv1a_mps = measure(fnv1a);
+        double tab_full_mps = measure(tab_full);
+
+        // The base hash is computed once per query
+        double tab_incr_mps = 0.0;
+        {
+            sig_generator gen;
+            timer t;
+            num_sigs = 0;
+            for (const uint8_t* q : queries) {
+                cur_hash = hasher(q, conf.dim);
+                gen.set(q, conf.dim, conf.dim, conf.bits, errs);
+                while (gen.has_next()) {
+                    sink ^= tab_incr(q, gen.next(), gen);
+                    ++num_sigs;
+                }
+            }
+            double elapsed = t.get<std::chrono::microseconds>();
+            tab_incr_mps = num_sigs / elapsed;
+        }
+
+        std::cout << num_sigs << "\t" << gen_only_mps << "\t" << gen_batch_mps << "\t" << fnv1a_mps << "\t" << tab_full_mps << "\t"
+                  << tab_incr_mps << std::endl;
+
+        uint64_t expected = 0;  // SIGSIZE has no entries for errs > dim
+        if (errs <= conf.dim) {
+            expected = get_sigsize(conf.bits, conf.dim, errs);
+            if (errs != 0) {
+                expected -= get_sigsize(conf.bits, conf.dim, errs - 1);
+            }
+        }
+        expected *= queries.size();
+        if (num_sigs != expected) {
+            std::cerr << "error: num_sigs != expected -> " << num_sigs << " != " << expected << std::endl;
+            return 1;
+        }
+        if (p.get<bool>("check") and !check(queries, conf, errs)) {
+            return 1;
+        }
+        if (sink == 0) {  // to keep the computation
+            std::cout << "(sink is zero)" << std::endl;
+        }
+    }
+
+    return 0;
+}
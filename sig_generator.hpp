@@ -7,8 +7,20 @@
 
 namespace sketch_search {
 
+// Enumerates the signatures with exactly errs substitutions in the first pfx_dim positions of base.
+// The signature is kept in one buffer and mutated in place: the substituted positions follow the
+// revolving-door order of combinations (Knuth's Algorithm R), and the substituted integers follow the
+// reflected Gray code over the positions. Consequently, each signature differs from the previous one
+// at one position, or at two positions when the combination changes, and the changes are reported
+// by get_deltas().
 class sig_generator {
   public:
+    struct delta_t {
+        uint8_t pos;
+        uint8_t c_old;
+        uint8_t c_new;
+    };
+
     sig_generator() = default;
 
     void set(const uint8_t* base, int pfx_dim, int dim, int bits, int errs) {
@@ -22,55 +34,56 @@ class sig_generator {
         m_dim = dim;
         m_mask = (1 << bits) - 1;
         m_errs = errs;
+        m_num_deltas = 0;
+        m_first = true;
+        m_num_left = get_num_sigs_(pfx_dim, m_mask, errs);
+
+        std::memcpy(m_sig, m_base, m_dim);
 
-        for (int i = 0; i < errs; ++i) {
-            m_power[i] = i;
+        // R1: c_r = r for r in [0, errs), followed by the sentinel c_errs = pfx_dim
+        for (int r = 0; r < errs; ++r) {
+            m_combs[r] = uint8_t(r);
         }
-        m_power[errs] = m_pfx_dim + 1;
-        m_bit = errs - 1;
-        m_bitstr = 0;
+        m_combs[errs] = uint8_t(pfx_dim);
     }
 
     bool has_next() const {
-        return m_gen_ints or (m_bit != m_errs);
+        return m_num_left != 0;
     }
+
+    // Returns the buffer of the next signature
     const uint8_t* next() {
         assert(has_next());
 
-        if (m_gen_ints) {
-            return next_ints();
-        }
-
-        while (m_bit != -1) {
-            if (m_power[m_bit] == m_bit) {
-                m_bitstr ^= 1ULL << m_power[m_bit];
-            } else {
-                m_bitstr ^= 3ULL << (m_power[m_bit] - 1);
+        m_num_deltas = 0;
+        if (m_first) {
+            m_first = false;
+            for (int r = 0; r < m_errs; ++r) {
+                enter_(m_combs[r]);
             }
-            ++m_power[m_bit];
-            --m_bit;
-        }
-
-        uint64_t tmpstr = m_bitstr;
-        while ((++m_bit < m_errs) and (m_power[m_bit] == m_power[m_bit + 1] - 1)) {
-            assert(m_power[m_bit] > 0);
-            m_bitstr ^= 1ULL << (m_power[m_bit] - 1);
-            m_power[m_bit] = m_bit;
+        } else if (!next_digits_()) {
+            // All the digits are at either end, so a new combination starts the reflected code again
+            next_comb_();
         }
+        --m_num_left;
+        return m_sig;
+    }
 
-        m_gen_ints = true;
-
-        int r = 0;
-        for (uint8_t i = 0; r < m_errs; ++i) {
-            if (((tmpstr >> i) & 1ULL) == 1ULL) {
-                m_combs[r] = i;
-                m_chars[r] = m_base[i];
-                m_cntrs[r] = 1;
-                ++r;
-            }
+    // Copies up to max_sigs signatures into sigs (dim integers each) and returns the number of them
+    size_t next_batch(uint8_t* sigs, size_t max_sigs) {
+        size_t num_sigs = 0;
+        for (; num_sigs < max_sigs and has_next(); ++num_sigs) {
+            std::memcpy(sigs + num_sigs * m_dim, next(), m_dim);
         }
+        return num_sigs;
+    }
 
-        return next_ints();
+    // Positions changed by the last next() from the previous signature (or from base for the first one)
+    const delta_t* get_deltas() const {
+        return m_deltas;
+    }
+    int get_num_deltas() const {
+        return m_num_deltas;
     }
 
   private:
@@ -79,40 +92,119 @@ class sig_generator {
     int m_pfx_dim = 0;
     int m_mask = 0;
     int m_errs = 0;
+    bool m_first = false;
+    uint64_t m_num_left = 0;  // #signatures not generated yet (saturated)
 
     uint8_t m_sig[64];
 
-    // For combination
-    uint64_t m_bitstr = 0;
-    int m_bit = 0;
-    int m_power[64];
+    // For combination, c_0 < c_1 < ... < c_{errs-1} and the sentinel
+    uint8_t m_combs[65];
 
-    // For int codes
-    bool m_gen_ints = false;
-    uint8_t m_combs[64];
-    uint8_t m_chars[64];
-    uint8_t m_cntrs[64];
+    // For int codes, the i-th position has m_sig[i] = m_base[i] + m_digits[i] + 1 (mod sigma) and
+    // moves in direction m_ups[i]
+    uint8_t m_digits[64];
+    bool m_ups[64];
 
-    const uint8_t* next_ints() {
-        std::memcpy(m_sig, m_base, m_dim);
+    delta_t m_deltas[64];
+    int m_num_deltas = 0;
+
+    void put_(int pos, uint8_t c) {
+        m_deltas[m_num_deltas++] = delta_t{uint8_t(pos), m_sig[pos], c};
+        m_sig[pos] = c;
+    }
+    void set_digit_(int pos, uint8_t digit) {
+        m_digits[pos] = digit;
+        put_(pos, uint8_t((m_base[pos] + digit + 1) & m_mask));
+    }
+    void enter_(int pos) {
+        m_ups[pos] = true;
+        set_digit_(pos, 0);
+    }
+    void leave_(int pos) {
+        put_(pos, m_base[pos]);
+    }
 
-        int r = 0;
-        for (r = 0; r < m_errs; ++r) {
-            m_sig[m_combs[r]] = uint8_t((m_chars[r] + m_cntrs[r]) & m_mask);
+    // Moves the first movable digit in the reflected Gray code order and turns the digits before it
+    bool next_digits_() {
+        for (int r = 0; r < m_errs; ++r) {
+            const int pos = m_combs[r];
+            if (m_ups[pos] and m_digits[pos] + 1 < m_mask) {
+                set_digit_(pos, m_digits[pos] + 1);
+                return true;
+            }
+            if (!m_ups[pos] and m_digits[pos] > 0) {
+                set_digit_(pos, m_digits[pos] - 1);
+                return true;
+            }
+            m_ups[pos] = !m_ups[pos];
         }
+        return false;
+    }
 
-        for (r = 0; r < m_errs; ++r) {
-            if (m_cntrs[r] < m_mask) {
-                ++m_cntrs[r];
-                break;
+    // One step of Algorithm R with 0-origin indices, applying the leaving and entering positions
+    void next_comb_() {
+        const int t = m_errs;
+        uint8_t* c = m_combs;
+
+        // R3: easy case
+        int j = 1;
+        if (t % 2 == 1) {
+            if (c[0] + 1 < c[1]) {
+                leave_(c[0]);
+                enter_(++c[0]);
+                return;
+            }
+        } else {
+            if (c[0] > 0) {
+                leave_(c[0]);
+                enter_(--c[0]);
+                return;
             }
-            m_cntrs[r] = 1;
+            goto R5;
         }
-        if (r == m_errs) {
-            m_gen_ints = false;
+
+        for (;;) {
+            // R4: try to decrease c_j
+            assert(j < t);
+            if (c[j] >= j + 1) {
+                leave_(c[j]);
+                enter_(j - 1);
+                c[j] = c[j - 1];
+                c[j - 1] = uint8_t(j - 1);
+                return;
+            }
+            ++j;
+        R5:
+            // R5: try to increase c_j (never fails before the last signature)
+            assert(j < t);
+            if (c[j] + 1 < c[j + 1]) {
+                leave_(c[j - 1]);
+                enter_(c[j] + 1);
+                c[j - 1] = c[j];
+                ++c[j];
+                return;
+            }
+            ++j;
         }
-        return m_sig;
+    }
+
+    // C(n, t) * m^t saturated at UINT64_MAX
+    static uint64_t get_num_sigs_(int n, int m, int t) {
+        if (t > n) {
+            return 0;
+        }
+        unsigned __int128 num = 1;
+        for (int i = 0; i < t; ++i) {
+            num = num * (n - i) / (i + 1);  // C(n, i + 1), which fits since C(64, 32) < 2^61
+        }
+        for (int i = 0; i < t; ++i) {
+            num *= m;
+            if (num > UINT64_MAX) {
+                return UINT64_MAX;
+            }
+        }
+        return uint64_t(num);
     }
 };
 
-}  // namespace sketch_search
\ No newline at end of file
+}  // namespace sketch_search
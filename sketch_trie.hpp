@@ -1,5 +1,8 @@
 #pragma once
 
+#include <map>
+#include <type_traits>
+
 #include "bit_vector.hpp"
 #include "misc.hpp"
 
@@ -19,25 +22,59 @@ class sketch_trie {
         build_trie(keys);
     }
 
+    // Height of the trie (i.e., the super and medium dense layers) built from the nodes of parse_trie, below
+    // which the suffixes are stored. The medium dense layer stops before a level of more than
+    // #keys / suf_thr nodes.
+    static int get_trie_height(const std::vector<std::vector<uint32_t>>& node_begs, int bits, float suf_thr) {
+        const int dim = int(node_begs.size()) - 1;
+        const uint64_t num_entries = node_begs[0].back();
+        int h = get_perf_height_(node_begs, bits);
+        for (; h < dim; ++h) {
+            if ((node_begs[h + 1].size() - 1) * suf_thr > num_entries) {
+                break;
+            }
+        }
+        return h;
+    }
+
     class searcher {
       public:
         searcher() = default;
 
         const std::vector<score_t>& operator()(const uint8_t* q, int max_errs, stat_t& stat) {
             m_score.clear();
+            (*this)(q, max_errs, stat, [&](uint32_t id, int errs) {
+                m_score.push_back({id, errs});
+                return true;
+            });
+            return m_score;
+        }
+
+        // Calls visit(id, errs) for each answer as soon as it is found, without materializing the answers.
+        // The search stops once visit returns false, and then false is returned.
+        template <class Visitor>
+        bool operator()(const uint8_t* q, int max_errs, stat_t& stat, Visitor&& visit) {
             if (max_errs < 0) {
-                return m_score;
+                return true;
             }
 
             m_q = q;
             m_max_errs = max_errs;
+#ifdef ENABLE_STATS
+            m_stat = &stat;
+#endif
 
             if (m_obj->m_suf_dim != 0) {
                 to_vertical_code(m_q + m_trie_height, m_obj->m_conf.bits, m_obj->m_suf_dim, m_q_vert_suf);
             }
-            ph_traverse_(0, 0, 0);
+            return ph_traverse_(0, 0, 0, visit);
+        }
 
-            return m_score;
+        // Returns the number of answers, adding the sizes of ID groups from the ID boundaries
+        uint64_t count(const uint8_t* q, int max_errs, stat_t& stat) {
+            id_counter counter;
+            (*this)(q, max_errs, stat, counter);
+            return counter.num;
         }
 
       private:
@@ -48,39 +85,49 @@ class sketch_trie {
         const int m_trie_height = 0;
         int m_max_errs = 0;
         std::vector<score_t> m_score;
+#ifdef ENABLE_STATS
+        stat_t* m_stat = nullptr;
+#endif
 
         searcher(const sketch_trie* obj)
             : m_obj(obj), m_sigma(1 << obj->m_conf.bits), m_trie_height(obj->m_conf.dim - obj->m_suf_dim) {
             m_score.reserve(1U << 10);
         }
 
-        void ph_traverse_(int h, int errs, uint64_t rank) {
+        // The traversals return false if visit stopped the search
+        template <class Visitor>
+        bool ph_traverse_(int h, int errs, uint64_t rank, Visitor& visit) {
             if (h == m_obj->m_perf_height) {
-                traverse_(h, errs, rank);
-                return;
+                return traverse_(h, errs, rank, visit);
             }
 
+            COUNT_STAT(*m_stat, num_actnodes, 1);
+            COUNT_STAT(*m_stat, num_dense_nodes, 1);
+
             const int c = int(m_q[h]);
             rank *= m_sigma;
 
             if (errs == m_max_errs) {
-                ph_traverse_(h + 1, errs, rank + c);
-            } else {
-                for (int i = 0; i < m_sigma; ++i) {
-                    if (i == c) {
-                        ph_traverse_(h + 1, errs, rank + i);
-                    } else {
-                        ph_traverse_(h + 1, errs + 1, rank + i);
-                    }
+                return ph_traverse_(h + 1, errs, rank + c, visit);
+            }
+            for (int i = 0; i < m_sigma; ++i) {
+                if (!ph_traverse_(h + 1, i == c ? errs : errs + 1, rank + i, visit)) {
+                    return false;
                 }
             }
+            return true;
         }
 
-        void traverse_(int h, int errs, uint64_t rank) {
+        template <class Visitor>
+        bool traverse_(int h, int errs, uint64_t rank, Visitor& visit) {
             assert(0 <= errs and errs <= m_max_errs);
 
+            COUNT_STAT(*m_stat, num_actnodes, 1);
+
             if (h == m_trie_height) {
                 if (m_obj->m_suf_dim != 0) {
+                    COUNT_STAT(*m_stat, num_sparse_nodes, 1);
+                    COUNT_STAT(*m_stat, num_selects, 1);
                     uint64_t suf_beg = m_obj->m_suf_begs.select(rank);
                     uint64_t suf_end = suf_beg;
 
@@ -89,47 +136,36 @@ class sketch_trie {
                     do {
                         const auto vert_suf = m_obj->m_vert_sufs.begin() + suf_end * m_obj->m_conf.bits;
                         int hamdist = get_hamdist_v(vert_suf, m_q_vert_suf, m_obj->m_conf.bits, m_max_errs - errs);
+                        COUNT_STAT(*m_stat, num_sufs_scanned, 1);
 
                         if (errs + hamdist <= m_max_errs) {
-                            uint64_t id_beg = m_obj->m_id_begs.select(suf_end);
-                            uint64_t id_end = id_beg;
-
-                            assert(id_beg + 1 < m_obj->m_id_begs.size());
-
-                            int e = errs + hamdist;
-                            do {
-                                m_score.push_back({static_cast<uint32_t>(m_obj->m_ids[id_end]), e});
-                            } while (!m_obj->m_id_begs[++id_end]);
+                            COUNT_STAT(*m_stat, num_sufs_matched, 1);
+                            if (!visit_ids_(suf_end, errs + hamdist, visit)) {
+                                return false;
+                            }
                         }
                     } while (!m_obj->m_suf_begs[++suf_end]);
-                } else {
-                    uint64_t id_beg = m_obj->m_id_begs.select(rank);
-                    uint64_t id_end = id_beg;
-
-                    assert(id_beg + 1 < m_obj->m_id_begs.size());
-
-                    do {
-                        m_score.push_back({static_cast<uint32_t>(m_obj->m_ids[id_end]), errs});
-                    } while (!m_obj->m_id_begs[++id_end]);
+                    return true;
                 }
-                return;
+                return visit_ids_(rank, errs, visit);
             }
 
             const medium_aux_t& med_aux = m_obj->m_medium_auxes[h - m_obj->m_perf_height];
             uint64_t c = m_q[h];
 
             if (med_aux.nd_type == DHT) {  // DHT
+                COUNT_STAT(*m_stat, num_dht_nodes, 1);
+                COUNT_STAT(*m_stat, num_ranks, 1);
                 uint64_t pos_beg = med_aux.begin + (rank << m_obj->m_conf.bits);
                 assert(pos_beg + m_sigma <= m_obj->m_dhts.size());
 
                 if (errs == m_max_errs) {
                     uint64_t pos = pos_beg + c;
                     if (!m_obj->m_dhts[pos]) {
-                        return;
+                        return true;
                     }
                     uint64_t next_rank = m_obj->m_dhts.rank(pos) - med_aux.prefix_sum;
-                    traverse_(h + 1, errs, next_rank);
-                    return;
+                    return traverse_(h + 1, errs, next_rank, visit);
                 }
 
                 uint64_t next_rank = m_obj->m_dhts.rank(pos_beg) - med_aux.prefix_sum;
@@ -139,26 +175,53 @@ class sketch_trie {
                     if (!m_obj->m_dhts[pos]) {
                         continue;
                     }
-                    traverse_(h + 1, i == c ? errs : errs + 1, next_rank++);
+                    if (!traverse_(h + 1, i == c ? errs : errs + 1, next_rank++, visit)) {
+                        return false;
+                    }
                 }
             } else {  // List
+                COUNT_STAT(*m_stat, num_list_nodes, 1);
+                COUNT_STAT(*m_stat, num_selects, 1);
                 uint64_t pos = m_obj->m_list_bits.select(rank + med_aux.prefix_sum);
                 if (errs == m_max_errs) {
                     do {
                         if (m_obj->m_list_chars[pos] == c) {
-                            traverse_(h + 1, errs, pos - med_aux.begin);
+                            return traverse_(h + 1, errs, pos - med_aux.begin, visit);
                         }
                     } while (!m_obj->m_list_bits[++pos]);
-                    return;
+                    return true;
                 }
                 do {
-                    if (m_obj->m_list_chars[pos] == c) {
-                        traverse_(h + 1, errs, pos - med_aux.begin);
-                    } else {
-                        traverse_(h + 1, errs + 1, pos - med_aux.begin);
+                    const int next_errs = m_obj->m_list_chars[pos] == c ? errs : errs + 1;
+                    if (!traverse_(h + 1, next_errs, pos - med_aux.begin, visit)) {
+                        return false;
                     }
                 } while (!m_obj->m_list_bits[++pos]);
             }
+            return true;
+        }
+
+        // Visits the IDs of the group-th ID group, whose size is given by the next boundary for id_counter
+        template <class Visitor>
+        bool visit_ids_(uint64_t group, int errs, Visitor& visit) {
+            COUNT_STAT(*m_stat, num_selects, 1);
+            uint64_t id_beg = m_obj->m_id_begs.select(group);
+            assert(id_beg + 1 < m_obj->m_id_begs.size());
+
+            if constexpr (std::is_same<Visitor, id_counter>::value) {
+                COUNT_STAT(*m_stat, num_selects, 1);
+                visit.num += m_obj->m_id_begs.select(group + 1) - id_beg;
+                return true;
+            }
+
+            uint64_t id_end = id_beg;
+            do {
+                if (!visit(static_cast<uint32_t>(m_obj->m_ids[id_end]), errs)) {
+                    return false;
+                }
+            } while (!m_obj->m_id_begs[++id_end]);
+            COUNT_STAT(*m_stat, num_ids, id_end - id_beg);
+            return true;
         }
 
         friend class sketch_trie;
@@ -184,29 +247,152 @@ class sketch_trie {
         os << "--> perf_height: " << m_perf_height << '\n';
         os << "--> suff_dim: " << m_suf_dim << '\n';
         os << "--> suf_thr: " << m_conf.suf_thr << '\n';
-        os << "--> rep_type: " << get_rep_name(m_conf.rep_type) << std::endl;
+        os << "--> rep_type: " << get_rep_name(m_conf.rep_type) << '\n';
+
+        std::map<std::string, int> num_levels;
+        for (const auto& shape : get_level_shapes()) {
+            ++num_levels[shape.layer];
+        }
+        os << "--> levels: " << num_levels["dense"] << " dense; " << num_levels["DHT"] << " DHT; " << num_levels["LIST"]
+           << " LIST\n";
+        os << "--> leaves: ";
+        show_sizes_(os, get_suf_bucket_sizes(), "suffixes");
+        os << "--> distinct keys: ";
+        show_sizes_(os, get_id_group_sizes(), "ids");
+        os << std::flush;
+    }
+
+    // Shape of the trie at a level above the sparse layer, where the fanout is #children of a node
+    struct level_shape_t {
+        std::string layer;  // dense, DHT, or LIST
+        uint64_t num_nodes;
+        uint64_t num_children;
+        uint64_t max_fanout;
+    };
+
+    std::vector<level_shape_t> get_level_shapes() const {
+        const uint64_t sigma = 1ULL << m_conf.bits;
+        const int trie_height = m_conf.dim - m_suf_dim;
+        std::vector<level_shape_t> shapes;
+
+        uint64_t num_nodes = 1;
+        for (int h = 0; h < m_perf_height; ++h) {
+            shapes.push_back({"dense", num_nodes, num_nodes * sigma, sigma});
+            num_nodes *= sigma;
+        }
+
+        for (int h = m_perf_height; h < trie_height; ++h) {
+            const size_t i = h - m_perf_height;
+            const medium_aux_t& med_aux = m_medium_auxes[i];
+            const uint64_t end = get_medium_end_(i);
+
+            level_shape_t shape = {med_aux.nd_type == DHT ? "DHT" : "LIST", 0, 0, 0};
+            if (med_aux.nd_type == DHT) {
+                for (uint64_t pos_beg = med_aux.begin; pos_beg < end; pos_beg += sigma) {
+                    uint64_t fanout = 0;
+                    for (uint64_t pos = pos_beg; pos < pos_beg + sigma; ++pos) {
+                        fanout += m_dhts[pos];
+                    }
+                    ++shape.num_nodes;
+                    shape.num_children += fanout;
+                    shape.max_fanout = std::max(shape.max_fanout, fanout);
+                }
+            } else {
+                uint64_t fanout = 0;
+                for (uint64_t pos = med_aux.begin; pos < end; ++pos) {
+                    if (m_list_bits[pos]) {
+                        shape.max_fanout = std::max(shape.max_fanout, fanout);
+                        fanout = 0;
+                        ++shape.num_nodes;
+                    }
+                    ++fanout;
+                    ++shape.num_children;
+                }
+                shape.max_fanout = std::max(shape.max_fanout, fanout);
+            }
+            shapes.push_back(shape);
+        }
+        return shapes;
+    }
+
+    // Distribution of #suffixes in a leaf (i.e., a bucket of the sparse layer), as size -> #leaves
+    std::map<uint64_t, uint64_t> get_suf_bucket_sizes() const {
+        if (m_suf_dim == 0) {  // each leaf is a distinct key
+            std::map<uint64_t, uint64_t> sizes;
+            for (const auto& kv : get_id_group_sizes()) {
+                sizes[1] += kv.second;
+            }
+            return sizes;
+        }
+        return get_run_sizes_(m_suf_begs);
+    }
+
+    // Distribution of #IDs of a distinct key, as size -> #keys
+    std::map<uint64_t, uint64_t> get_id_group_sizes() const {
+        return get_run_sizes_(m_id_begs);
+    }
+
+    // Writes the shape in CSV rows of (block, stat, key, value), where key is a level or a size
+    void write_shape_csv(std::ostream& os, int block) const {
+        const auto shapes = get_level_shapes();
+        for (size_t h = 0; h < shapes.size(); ++h) {
+            const auto& shape = shapes[h];
+            os << block << ",layer," << h << ',' << shape.layer << '\n';
+            os << block << ",num_nodes," << h << ',' << shape.num_nodes << '\n';
+            os << block << ",ave_fanout," << h << ',' << double(shape.num_children) / shape.num_nodes << '\n';
+            os << block << ",max_fanout," << h << ',' << shape.max_fanout << '\n';
+        }
+        for (const auto& kv : get_suf_bucket_sizes()) {
+            os << block << ",suf_bucket_size," << kv.first << ',' << kv.second << '\n';
+        }
+        for (const auto& kv : get_id_group_sizes()) {
+            os << block << ",id_group_size," << kv.first << ',' << kv.second << '\n';
+        }
     }
 
     size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
         auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
         size_type written_bytes = 0;
         written_bytes += sdsl::serialize(m_conf, out, child, "m_conf");
-        written_bytes += sdsl::serialize(m_perf_height, out, child, "m_perf_height");
-        written_bytes += sdsl::serialize(m_medium_auxes, out, child, "m_medium_auxes");
-        written_bytes += sdsl::serialize(m_dhts, out, child, "m_dhts");
-        written_bytes += sdsl::serialize(m_list_bits, out, child, "m_list_bits");
-        written_bytes += sdsl::serialize(m_list_chars, out, child, "m_list_chars");
-        written_bytes += sdsl::serialize(m_suf_dim, out, child, "m_suf_dim");
-        written_bytes += sdsl::serialize(m_vert_sufs, out, child, "m_vert_sufs");
-        written_bytes += sdsl::serialize(m_suf_begs, out, child, "m_suf_begs");
-        written_bytes += sdsl::serialize(m_ids, out, child, "m_ids");
-        written_bytes += sdsl::serialize(m_id_begs, out, child, "m_id_begs");
+
+        // The members are grouped by layers only in the structure tree (for memory reports)
+        auto add_layer = [&](const char* layer_name, auto&& serialize_members) {
+            auto layer = sdsl::structure_tree::add_child(child, layer_name, "layer");
+            size_type layer_bytes = serialize_members(layer);
+            sdsl::structure_tree::add_size(layer, layer_bytes);
+            written_bytes += layer_bytes;
+        };
+        add_layer("dense_layer", [&](sdsl::structure_tree_node* layer) {
+            return sdsl::serialize(m_perf_height, out, layer, "m_perf_height");
+        });
+        add_layer("medium_layer", [&](sdsl::structure_tree_node* layer) {
+            size_type bytes = 0;
+            bytes += sdsl::serialize(m_medium_auxes, out, layer, "m_medium_auxes");
+            bytes += sdsl::serialize(m_dhts, out, layer, "m_dhts");
+            bytes += sdsl::serialize(m_list_bits, out, layer, "m_list_bits");
+            bytes += sdsl::serialize(m_list_chars, out, layer, "m_list_chars");
+            return bytes;
+        });
+        add_layer("sparse_layer", [&](sdsl::structure_tree_node* layer) {
+            size_type bytes = 0;
+            bytes += sdsl::serialize(m_suf_dim, out, layer, "m_suf_dim");
+            bytes += sdsl::serialize(m_vert_sufs, out, layer, "m_vert_sufs");
+            bytes += sdsl::serialize(m_suf_begs, out, layer, "m_suf_begs");
+            return bytes;
+        });
+        add_layer("id_layer", [&](sdsl::structure_tree_node* layer) {
+            size_type bytes = 0;
+            bytes += sdsl::serialize(m_ids, out, layer, "m_ids");
+            bytes += sdsl::serialize(m_id_begs, out, layer, "m_id_begs");
+            return bytes;
+        });
+
         sdsl::structure_tree::add_size(child, written_bytes);
         return written_bytes;
     }
 
     void load(std::istream& in) {
-        sdsl::load(m_conf, in);
+        load_config(m_conf, in);
         sdsl::load(m_perf_height, in);
         sdsl::load(m_medium_auxes, in);
         sdsl::load(m_dhts, in);
@@ -271,24 +457,66 @@ class sketch_trie {
     sdsl::int_vector<> m_ids;
     bit_vector m_id_begs;  // suffix to ids
 
-    void build_trie(std::vector<const uint8_t*>& keys) {
-        auto entries = make_entries(keys, m_conf.dim);
-        auto node_begs = parse_trie(entries, m_conf.dim);
+    // The end position of the i-th medium level in m_dhts or m_list_bits, that is, the beginning of the
+    // next level of the same type
+    uint64_t get_medium_end_(size_t i) const {
+        for (size_t j = i + 1; j < m_medium_auxes.size(); ++j) {
+            if (m_medium_auxes[j].nd_type == m_medium_auxes[i].nd_type) {
+                return m_medium_auxes[j].begin;
+            }
+        }
+        return m_medium_auxes[i].nd_type == DHT ? m_dhts.size() : m_list_bits.size() - 1;  // excludes the sentinel
+    }
 
-        auto num_leaves = [&](int h) -> uint64_t { return node_begs[h].size() - 1; };
+    // Sizes of the runs delimited by the set bits, where the last bit is the sentinel
+    static std::map<uint64_t, uint64_t> get_run_sizes_(const bit_vector& begs) {
+        std::map<uint64_t, uint64_t> sizes;
+        uint64_t beg = 0;
+        for (uint64_t i = 1; i < begs.size(); ++i) {
+            if (begs[i]) {
+                ++sizes[i - beg];
+                beg = i;
+            }
+        }
+        return sizes;
+    }
 
-        // 1. Super dense layer
+    static void show_sizes_(std::ostream& os, const std::map<uint64_t, uint64_t>& sizes, const char* unit) {
+        uint64_t num = 0, sum = 0;
+        for (const auto& kv : sizes) {
+            num += kv.second;
+            sum += kv.first * kv.second;
+        }
+        os << num << "; ave " << (num == 0 ? 0.0 : double(sum) / num) << " " << unit << "; max "
+           << (sizes.empty() ? 0 : sizes.rbegin()->first) << " " << unit << '\n';
+    }
+
+    // Height of the super dense layer, whose levels are complete
+    static int get_perf_height_(const std::vector<std::vector<uint32_t>>& node_begs, int bits) {
         int h = 0;
 #ifdef UNDEFINE_DENSE_LAYER
         std::cerr << "!! UNDEFINE_DENSE_LAYER !!" << std::endl;
 #else
-        for (; h < m_conf.dim; ++h) {
-            if ((num_leaves(h) << m_conf.bits) != num_leaves(h + 1)) {
+        const int dim = int(node_begs.size()) - 1;
+        for (; h < dim; ++h) {
+            if (((node_begs[h].size() - 1) << bits) != node_begs[h + 1].size() - 1) {
                 break;
             }
         }
 #endif
+        return h;
+    }
+
+    void build_trie(std::vector<const uint8_t*>& keys) {
+        auto entries = make_entries(keys, m_conf.dim, m_conf.bits);
+        auto node_begs = parse_trie(entries, m_conf.dim);
+
+        auto num_leaves = [&](int h) -> uint64_t { return node_begs[h].size() - 1; };
+
+        // 1. Super dense layer
+        int h = get_perf_height_(node_begs, m_conf.bits);
         m_perf_height = h;
+        const int trie_height = get_trie_height(node_begs, m_conf.bits, m_conf.suf_thr);
 
         // 2. Medium dense layer
         {
@@ -316,11 +544,7 @@ class sketch_trie {
                     exit(1);
             }
 
-            for (; h < m_conf.dim; ++h) {
-                if (num_leaves(h + 1) * m_conf.suf_thr > entries.size()) {
-                    break;
-                }
-
+            for (; h < trie_height; ++h) {
                 const float ave_degree = float(num_leaves(h + 1)) / num_leaves(h);
                 const ds_types ds_type = (ave_degree >= ds_thr) ? DHT : LIST;
 
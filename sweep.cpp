@@ -0,0 +1,346 @@
+#include "bench_utils.hpp"
+#include "hash_table.hpp"
+#include "histogram.hpp"
+#include "hybrid_engine.hpp"
+#include "multi_index.hpp"
+#include "scan_index.hpp"
+#include "sketch_trie.hpp"
+
+#include "cmdline.h"
+
+using namespace sketch_search;
+
+struct sweep_row_t {
+    std::string name;
+    config_t conf;
+    bool uses_trie;  // suf_thr and rep_type are effective
+    uint64_t num_keys;
+    uint64_t num_queries;
+    double build_sec;
+    uint64_t index_bytes;
+    int errs;
+    double ms_per_query;
+    double cands_per_query;
+    double ans_per_query;
+    double p99_us;
+    std::string engines;  // chosen by hybrid for the blocks
+};
+
+// Writes rows in CSV (with a header) or in JSON lines
+class row_writer {
+  public:
+    row_writer(std::ostream& os, bool json) : m_os(os), m_json(json) {
+        if (!m_json) {
+            m_os << "name,dim,bits,blocks,suf_thr,rep_type,num_keys,num_queries,build_sec,index_bytes,errs,"
+                    "ms_per_query,cands_per_query,ans_per_query,p99_us,engines\n";
+        }
+    }
+
+    void write(const sweep_row_t& r) {
+        std::ostringstream suf_thr_oss;
+        if (r.uses_trie) {
+            suf_thr_oss << r.conf.suf_thr;
+        }
+        const std::string suf_thr = suf_thr_oss.str();
+        const std::string rep_type = r.uses_trie ? get_rep_name(r.conf.rep_type) : "";
+        if (m_json) {
+            m_os << "{\"name\": \"" << r.name << "\", \"dim\": " << r.conf.dim << ", \"bits\": " << r.conf.bits
+                 << ", \"blocks\": " << r.conf.blocks << ", \"suf_thr\": " << (r.uses_trie ? suf_thr : "null")
+                 << ", \"rep_type\": " << (r.uses_trie ? "\"" + rep_type + "\"" : "null")
+                 << ", \"num_keys\": " << r.num_keys << ", \"num_queries\": " << r.num_queries
+                 << ", \"build_sec\": " << r.build_sec << ", \"index_bytes\": " << r.index_bytes
+                 << ", \"errs\": " << r.errs << ", \"ms_per_query\": " << r.ms_per_query
+                 << ", \"cands_per_query\": " << r.cands_per_query << ", \"ans_per_query\": " << r.ans_per_query
+                 << ", \"p99_us\": " << r.p99_us << ", \"engines\": "
+                 << (r.engines.empty() ? "null" : "\"" + r.engines + "\"") << "}\n";
+        } else {
+            m_os << r.name << ',' << r.conf.dim << ',' << r.conf.bits << ',' << r.conf.blocks << ',' << suf_thr << ','
+                 << rep_type << ',' << r.num_keys << ',' << r.num_queries << ',' << r.build_sec << ','
+                 << r.index_bytes << ',' << r.errs << ',' << r.ms_per_query << ',' << r.cands_per_query << ','
+                 << r.ans_per_query << ',' << r.p99_us << ',' << r.engines << '\n';
+        }
+        m_os << std::flush;
+    }
+
+  private:
+    std::ostream& m_os;
+    bool m_json;
+};
+
+// Engines chosen by hybrid for the blocks, joined by '+' (empty for the other indexes)
+template <class Index>
+std::string get_engines(const Index&) {
+    return "";
+}
+std::string get_engines(const hybrid_engine& index) {
+    return index.get_engine_name();
+}
+std::string get_engines(const multi_index<hybrid_engine>& index) {
+    std::string engines;
+    for (int b = 0; b < index.num_blocks(); ++b) {
+        engines += (b == 0 ? "" : "+") + index.get_index(b).get_engine_name();
+    }
+    return engines;
+}
+
+// Builds the index once and searches for every radius. Returns false if terminated by ABORT_BORDER_IN_MS.
+template <class Index>
+bool sweep_index(const std::string& name, const config_t& conf, bool uses_trie, const std::vector<const uint8_t*>& keys,
+                 const std::vector<const uint8_t*>& queries, const std::vector<int>& radii, row_writer& writer) {
+    std::cout << "### " << short_realname<Index>() << ": " << conf.dim << "m" << conf.bits << "b" << conf.blocks
+              << "B";
+    if (uses_trie) {
+        std::cout << "; suf_thr " << conf.suf_thr << "; " << get_rep_name(conf.rep_type);
+    }
+    std::cout << " ###" << std::endl;
+
+    Index index;
+    timer build_t;
+    {
+        std::vector<const uint8_t*> build_keys = keys;
+        index.build(build_keys, conf);
+    }
+    const double build_sec = build_t.get<std::chrono::milliseconds>() / 1000.0;
+    const uint64_t index_bytes = sdsl::size_in_bytes(index);
+    std::cout << "--> " << build_sec << " sec; " << index_bytes << " bytes" << std::endl;
+
+    const std::string engines = get_engines(index);
+    if (!engines.empty()) {
+        std::cout << "--> engines: " << engines << std::endl;
+    }
+
+    auto searcher = index.make_searcher();
+    set_query_threads(searcher, conf.threads);
+    latency_histogram hist;
+
+    for (int errs : radii) {
+        size_t num_ans = 0;
+        stat_t stat;
+        hist.clear();
+
+        timer t;
+        for (const uint8_t* q : queries) {
+            timer qt;
+            searcher(q, errs, stat, [&](uint32_t, int) {
+                ++num_ans;
+                return true;
+            });
+            hist.record(uint64_t(qt.get<std::chrono::nanoseconds>()));
+        }
+        const double elapsed = t.get<std::chrono::microseconds>() / 1000.0;
+
+        const double n = double(queries.size());
+        sweep_row_t row;
+        row.name = name;
+        row.conf = conf;
+        row.uses_trie = uses_trie;
+        row.num_keys = keys.size();
+        row.num_queries = queries.size();
+        row.build_sec = build_sec;
+        row.index_bytes = index_bytes;
+        row.errs = errs;
+        row.ms_per_query = elapsed / n;
+        row.cands_per_query = stat.num_cands / n;
+        row.ans_per_query = num_ans / n;
+        row.p99_us = hist.get_percentile(99.0) / 1000.0;
+        row.engines = engines;
+        writer.write(row);
+        std::cout << "--> " << errs << " errs; " << row.ans_per_query << " ans; " << row.cands_per_query
+                  << " cands; " << row.ms_per_query << " ms" << std::endl;
+
+        if (ABORT_BORDER_IN_MS * queries.size() < elapsed) {
+            std::cout << "**** forced termination due to ABORT_BORDER_IN_MS!! ****" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Since hybrid chooses the engines for conf.errs, it is built for each radius
+template <class Index>
+void sweep_hybrid(const std::string& name, const config_t& conf, const std::vector<const uint8_t*>& keys,
+                  const std::vector<const uint8_t*>& queries, const std::vector<int>& radii, row_writer& writer) {
+    for (int errs : radii) {
+        config_t conf_e = conf;
+        conf_e.errs = errs;
+        if (!sweep_index<Index>(name, conf_e, true, keys, queries, {errs}, writer)) {
+            break;
+        }
+    }
+}
+
+// Returns false if the combination of name and blocks is not supported
+bool sweep(const std::string& name, const config_t& conf, const std::vector<const uint8_t*>& keys,
+           const std::vector<const uint8_t*>& queries, const std::vector<int>& radii, row_writer& writer) {
+    const bool uses_trie = name == "trie" or name == "hybrid";
+    if (conf.blocks == 1) {
+        if (name == "hash") {
+            sweep_index<hash_table>(name, conf, uses_trie, keys, queries, radii, writer);
+            return true;
+        }
+        if (name == "trie") {
+            sweep_index<sketch_trie>(name, conf, uses_trie, keys, queries, radii, writer);
+            return true;
+        }
+        if (name == "hybrid") {
+            sweep_hybrid<hybrid_engine>(name, conf, keys, queries, radii, writer);
+            return true;
+        }
+        if (name == "scan") {
+            sweep_index<scan_index>(name, conf, uses_trie, keys, queries, radii, writer);
+            return true;
+        }
+    } else {
+        if (name == "hash") {
+            sweep_index<multi_index<hash_table>>(name, conf, uses_trie, keys, queries, radii, writer);
+            return true;
+        }
+        if (name == "trie") {
+            sweep_index<multi_index<sketch_trie>>(name, conf, uses_trie, keys, queries, radii, writer);
+            return true;
+        }
+        if (name == "hybrid") {
+            sweep_hybrid<multi_index<hybrid_engine>>(name, conf, keys, queries, radii, writer);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes the first dim integers of the raw sketches and masks them in bits
+std::vector<uint8_t> derive_sketches(const std::vector<uint8_t>& raw, int raw_dim, int dim, int bits) {
+    const size_t num = raw.size() / raw_dim;
+    const uint8_t mask = uint8_t((1U << bits) - 1);
+    std::vector<uint8_t> sketches(num * dim);
+    for (size_t i = 0; i < num; ++i) {
+        for (int j = 0; j < dim; ++j) {
+            sketches[i * dim + j] = raw[i * raw_dim + j] & mask;
+        }
+    }
+    return sketches;
+}
+
+int main(int argc, char* argv[]) {
+    cmdline::parser p;
+    p.add<std::string>("base_fn", 'd', "input file name of database sketches", true);
+    p.add<std::string>("query_fn", 'q', "input file name of query sketches", true);
+    p.add<std::string>("output_fn", 'o', "output file name of results", true);
+    p.add<std::string>("format", 'f', "output format (csv | json)", false, "csv");
+    p.add<std::string>("names", 'n', "index names (hash | trie | hybrid | scan), comma separated", false, "trie");
+    p.add<std::string>("dims", 'm', "dimensions (<= 64), comma separated", false, "32");
+    p.add<std::string>("bits", 'b', "#bits of alphabet (<= 8), comma separated", false, "2");
+    p.add<std::string>("blocks", 'B', "#blocks, comma separated", false, "1");
+    p.add<std::string>("suf_thrs", 's', "suf_thr of trie, comma separated", false, "2");
+    p.add<std::string>("rep_types", 'R', "node representations of trie (hybrid | dht | list), comma separated",
+                       false, "hybrid");
+    p.add<std::string>("errs_range", 'e', "range of errs (min:max:step)", false, "1:5:1");
+    p.add<float>("load_factor", 'l', "load factor of hash table (0 < l <= 1)", false, 0.875);
+    p.add<int>("threads", 'T', "#threads for construction (and queries of scan)", false,
+               int(std::thread::hardware_concurrency()));
+    p.parse_check(argc, argv);
+
+    auto base_fn = p.get<std::string>("base_fn");
+    auto query_fn = p.get<std::string>("query_fn");
+    auto output_fn = p.get<std::string>("output_fn");
+    auto format = p.get<std::string>("format");
+    auto names = parse_list<std::string>(p.get<std::string>("names"));
+    auto dims = parse_list<int>(p.get<std::string>("dims"));
+    auto bits_list = parse_list<int>(p.get<std::string>("bits"));
+    auto blocks_list = parse_list<int>(p.get<std::string>("blocks"));
+    auto suf_thrs = parse_list<float>(p.get<std::string>("suf_thrs"));
+
+    std::vector<node_reps> rep_types;
+    for (const auto& rep : parse_list<std::string>(p.get<std::string>("rep_types"))) {
+        if (rep == "hybrid") {
+            rep_types.push_back(node_reps::HYBRID);
+        } else if (rep == "dht") {
+            rep_types.push_back(node_reps::DHT);
+        } else if (rep == "list") {
+            rep_types.push_back(node_reps::LIST);
+        } else {
+            std::cerr << "error: invalid rep_type " << rep << std::endl;
+            return 1;
+        }
+    }
+
+    if (format != "csv" and format != "json") {
+        std::cerr << "error: invalid format " << format << std::endl;
+        return 1;
+    }
+    for (int dim : dims) {
+        if (dim == 0 or MAX_DIM < dim) {
+            std::cerr << "error: dim == 0 or MAX_DIM < dim" << std::endl;
+            return 1;
+        }
+    }
+    for (int bits : bits_list) {
+        if (bits == 0 or MAX_BITS < bits) {
+            std::cerr << "error: bits == 0 or MAX_BITS < bits" << std::endl;
+            return 1;
+        }
+    }
+
+    int min_errs, max_errs, err_step;
+    std::tie(min_errs, max_errs, err_step) = parse_range(p.get<std::string>("errs_range"));
+    std::vector<int> radii;
+    for (int errs = min_errs; errs <= max_errs; errs += err_step) {
+        radii.push_back(errs);
+    }
+
+    // The raw sketches are loaded once in the max dimension and 8 bits, and the sketches of each (dim, bits)
+    // are derived from them
+    config_t raw_conf;
+    raw_conf.dim = *std::max_element(dims.begin(), dims.end());
+    raw_conf.bits = 8;
+
+    std::cout << "Now loading keys and queries..." << std::endl;
+    const auto raw_keys = load_sketches(base_fn, raw_conf);
+    const auto raw_queries = load_sketches(query_fn, raw_conf);
+    std::cout << "--> " << raw_keys.size() / raw_conf.dim << " keys; " << raw_queries.size() / raw_conf.dim
+              << " queries" << std::endl;
+
+    std::ofstream ofs(output_fn);
+    if (!ofs) {
+        std::cerr << "open error: " << output_fn << std::endl;
+        return 1;
+    }
+    row_writer writer(ofs, format == "json");
+
+    for (int dim : dims) {
+        for (int bits : bits_list) {
+            config_t conf;
+            conf.dim = dim;
+            conf.bits = bits;
+            conf.errs = max_errs;
+            conf.threads = p.get<int>("threads");
+            conf.load_factor = p.get<float>("load_factor");
+            conf.pfx_filter = false;
+
+            const auto keys_buf = derive_sketches(raw_keys, raw_conf.dim, dim, bits);
+            const auto queries_buf = derive_sketches(raw_queries, raw_conf.dim, dim, bits);
+            const auto keys = extract_ptrs(keys_buf, conf);
+            const auto queries = extract_ptrs(queries_buf, conf);
+
+            for (const auto& name : names) {
+                const bool uses_trie = name == "trie" or name == "hybrid";
+                for (int blocks : blocks_list) {
+                    conf.blocks = blocks;
+                    conf.matches = 1;
+                    // suf_thr and rep_type are swept only for tries
+                    for (size_t s = 0; s < (uses_trie ? suf_thrs.size() : 1); ++s) {
+                        for (size_t r = 0; r < (uses_trie ? rep_types.size() : 1); ++r) {
+                            conf.suf_thr = suf_thrs[s];
+                            conf.rep_type = rep_types[r];
+                            if (!sweep(name, conf, keys, queries, radii, writer)) {
+                                std::cerr << "warning: skipped unsupported " << name << " with " << blocks
+                                          << " blocks" << std::endl;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
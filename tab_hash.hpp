@@ -0,0 +1,51 @@
+#pragma once
+
+#include <random>
+
+#include "misc.hpp"
+
+namespace sketch_search {
+
+// Simple tabulation hashing over positions: hash(key) = T[0][key[0]] ^ T[1][key[1]] ^ ...
+// Replacing one integer of a key updates the hash with two XORs, so signatures that differ from
+// their base sketch in a few positions are hashed in O(#positions) instead of O(dim).
+class tab_hash {
+  public:
+    static constexpr uint64_t SEED = 114514;
+
+    tab_hash() = default;
+
+    void build(int dim, int bits) {
+        m_bits = bits;
+        m_table.resize(size_t(dim) << bits);
+
+        std::mt19937_64 engine(SEED);
+        for (uint64_t& v : m_table) {
+            v = engine();
+        }
+    }
+
+    uint64_t operator()(const uint8_t* key, int dim) const {
+        uint64_t hash = 0;
+        for (int i = 0; i < dim; ++i) {
+            hash ^= get(i, key[i]);
+        }
+        return hash;
+    }
+
+    uint64_t get(int pos, uint8_t c) const {
+        assert((size_t(pos) << m_bits) + c < m_table.size());
+        return m_table[(size_t(pos) << m_bits) + c];
+    }
+
+    // Hash after replacing c_old at pos by c_new
+    uint64_t update(uint64_t hash, int pos, uint8_t c_old, uint8_t c_new) const {
+        return hash ^ get(pos, c_old) ^ get(pos, c_new);
+    }
+
+  private:
+    int m_bits = 0;
+    std::vector<uint64_t> m_table;
+};
+
+}  // namespace sketch_search
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+
+#include "scan_index.hpp"
+
+namespace sketch_search {
+
+// Answers of queries within max_errs, computed by the multi-threaded SIMD scan of scan_index.
+// The answers within a smaller radius are obtained by filtering, so one ground truth serves every radius
+// up to max_errs. It can be cached in a file, which is identified by the fingerprint of the keys and queries.
+class ground_truth {
+  public:
+    using size_type = uint64_t;  // for sdsl
+
+    ground_truth() = default;
+
+    void build(const std::vector<const uint8_t*>& keys, const std::vector<const uint8_t*>& queries,
+               const config_t& conf, int max_errs) {
+        m_dim = conf.dim;
+        m_bits = conf.bits;
+        m_max_errs = max_errs;
+        m_fingerprint = get_fingerprint(keys, queries, conf);
+
+        scan_index index;
+        index.build(keys, conf);
+
+        // Each thread scans for a range of queries
+        const int threads = std::max(conf.threads, 1);
+        std::vector<std::vector<score_t>> thread_scores(queries.size());
+        parallel_for(threads, threads, [&](size_t t) {
+            auto searcher = index.make_searcher();
+            stat_t stat;
+            for (size_t j = queries.size() * t / threads; j < queries.size() * (t + 1) / threads; ++j) {
+                thread_scores[j] = searcher(queries[j], max_errs, stat);  // in the order of IDs
+            }
+        });
+
+        m_begs.assign(1, 0);
+        m_scores.clear();
+        for (const auto& scores : thread_scores) {
+            m_scores.insert(m_scores.end(), scores.begin(), scores.end());
+            m_begs.push_back(m_scores.size());
+        }
+    }
+
+    // Whether this was built for the keys and queries within max_errs or more
+    bool is_valid_for(uint64_t fingerprint, int max_errs) const {
+        return m_fingerprint == fingerprint and max_errs <= m_max_errs;
+    }
+
+    // Answers of the j-th query within errs in the order of IDs
+    std::vector<score_t> get(size_t j, int errs) const {
+        std::vector<score_t> ret;
+        for (uint64_t i = m_begs[j]; i < m_begs[j + 1]; ++i) {
+            if (m_scores[i].errs <= errs) {
+                ret.push_back(m_scores[i]);
+            }
+        }
+        return ret;
+    }
+
+    uint64_t num_queries() const {
+        return m_begs.empty() ? 0 : m_begs.size() - 1;
+    }
+    int get_max_errs() const {
+        return m_max_errs;
+    }
+
+    // FNV-1a of the dimension, bits, keys, and queries
+    static uint64_t get_fingerprint(const std::vector<const uint8_t*>& keys, const std::vector<const uint8_t*>& queries,
+                                    const config_t& conf) {
+        uint64_t hash = 0xcbf29ce484222325;
+        auto update = [&](uint64_t v) {
+            hash ^= v;
+            hash *= 0x100000001b3;
+        };
+        update(uint64_t(conf.dim));
+        update(uint64_t(conf.bits));
+        for (const auto* sketches : {&keys, &queries}) {
+            update(sketches->size());
+            for (const uint8_t* sketch : *sketches) {
+                for (int i = 0; i < conf.dim; ++i) {
+                    update(sketch[i]);
+                }
+            }
+        }
+        return hash;
+    }
+
+    size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
+        auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
+        size_type written_bytes = 0;
+        written_bytes += sdsl::serialize(m_dim, out, child, "m_dim");
+        written_bytes += sdsl::serialize(m_bits, out, child, "m_bits");
+        written_bytes += sdsl::serialize(m_max_errs, out, child, "m_max_errs");
+        written_bytes += sdsl::serialize(m_fingerprint, out, child, "m_fingerprint");
+        written_bytes += sdsl::serialize(m_begs, out, child, "m_begs");
+        written_bytes += sdsl::serialize(m_scores, out, child, "m_scores");
+        sdsl::structure_tree::add_size(child, written_bytes);
+        return written_bytes;
+    }
+
+    void load(std::istream& in) {
+        sdsl::load(m_dim, in);
+        sdsl::load(m_bits, in);
+        sdsl::load(m_max_errs, in);
+        sdsl::load(m_fingerprint, in);
+        sdsl::load(m_begs, in);
+        sdsl::load(m_scores, in);
+    }
+
+  private:
+    int m_dim = 0;
+    int m_bits = 0;
+    int m_max_errs = -1;
+    uint64_t m_fingerprint = 0;
+    std::vector<uint64_t> m_begs;  // of answers of each query
+    std::vector<score_t> m_scores;
+};
+
+// A difference between the answers of an index and the ground truth, where errs of -1 means
+// that the ID is missing in either
+struct mismatch_t {
+    uint32_t query;
+    uint32_t id;
+    int true_errs;
+    int searched_errs;
+};
+
+// Searches for all the queries within errs with threads, each with its own searcher, and returns all the
+// differences from the ground truth in the order of queries
+template <class Index>
+std::vector<mismatch_t> validate(const Index& index, const std::vector<const uint8_t*>& queries,
+                                 const ground_truth& truth, int errs, int threads) {
+    threads = std::max(threads, 1);
+    std::vector<std::vector<mismatch_t>> thread_mismatches(threads);
+
+    parallel_for(threads, threads, [&](size_t t) {
+        auto searcher = index.make_searcher();
+        stat_t stat;
+        std::vector<score_t> searched;
+        for (size_t j = queries.size() * t / threads; j < queries.size() * (t + 1) / threads; ++j) {
+            searched.clear();
+            searcher(queries[j], errs, stat, [&](uint32_t id, int e) {
+                searched.push_back({id, e});
+                return true;
+            });
+            std::sort(searched.begin(), searched.end(),
+                      [](const score_t& lhs, const score_t& rhs) { return lhs.id < rhs.id; });
+            const std::vector<score_t> expected = truth.get(j, errs);
+
+            auto& mismatches = thread_mismatches[t];
+            size_t i = 0, k = 0;
+            while (i < expected.size() or k < searched.size()) {
+                if (k == searched.size() or (i < expected.size() and expected[i].id < searched[k].id)) {
+                    mismatches.push_back({uint32_t(j), expected[i].id, expected[i].errs, -1});
+                    ++i;
+                } else if (i == expected.size() or searched[k].id < expected[i].id) {
+                    mismatches.push_back({uint32_t(j), searched[k].id, -1, searched[k].errs});
+                    ++k;
+                } else {
+                    if (expected[i].errs != searched[k].errs) {
+                        mismatches.push_back({uint32_t(j), expected[i].id, expected[i].errs, searched[k].errs});
+                    }
+                    ++i, ++k;
+                }
+            }
+        }
+    });
+
+    std::vector<mismatch_t> mismatches;
+    for (const auto& m : thread_mismatches) {
+        mismatches.insert(mismatches.end(), m.begin(), m.end());
+    }
+    return mismatches;
+}
+
+}  // namespace sketch_search